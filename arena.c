@@ -0,0 +1,120 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+// the strictest alignment anything we allocate could need (gnu99 has
+// no max_align_t)
+typedef union ArenaAlign {
+    long double ld;
+    long long ll;
+    void *ptr;
+} ArenaAlign;
+
+#define ARENA_ALIGN (sizeof(ArenaAlign))
+
+/*
+** A bump allocator for everything that only lives as long as one line:
+** Commands, args arrays, token strings and expanded lines. Memory comes
+** from a chain of blocks; allocating bumps an offset in the current
+** block, and arena_reset rewinds to the first block in O(1). Blocks are
+** kept across resets, so a loop that reads the same shape of line over
+** and over stops calling malloc altogether.
+*/
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t cap;
+    size_t used;
+    ArenaAlign data[];
+};
+
+static ArenaBlock *new_block(Arena *arena, size_t min_size){
+    size_t block_size = arena->block_size ? arena->block_size : ARENA_BLOCK_SIZE;
+    size_t cap = min_size > block_size ? min_size : block_size;
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + cap);
+    if (block == NULL){
+        perror("arena_alloc");
+        exit(EXIT_FAILURE);
+    }
+    block->next = NULL;
+    block->cap = cap;
+    block->used = 0;
+    return block;
+}
+
+
+void *arena_alloc(Arena *arena, size_t size){
+    // round up so every allocation stays suitably aligned
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (arena->current == NULL){
+        arena->first = arena->current = new_block(arena, size);
+    }
+
+    // move along the chain (blocks past current are stale from an
+    // earlier line) until one fits, making room if none does
+    while (arena->current->cap - arena->current->used < size){
+        ArenaBlock *next = arena->current->next;
+        if (next == NULL || next->cap < size){
+            ArenaBlock *block = new_block(arena, size);
+            block->next = next;
+            arena->current->next = block;
+            next = block;
+        }
+        next->used = 0;
+        arena->current = next;
+    }
+
+    void *mem = (char *) arena->current->data + arena->current->used;
+    arena->current->used += size;
+
+    #ifdef DEBUG
+    arena->num_allocs++;
+    arena->num_bytes += size;
+    #endif
+
+    return mem;
+}
+
+
+char *arena_strndup(Arena *arena, const char *str, size_t len){
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+
+char *arena_strdup(Arena *arena, const char *str){
+    return arena_strndup(arena, str, strlen(str));
+}
+
+
+void arena_reset(Arena *arena){
+    #ifdef DEBUG
+    if (arena->num_allocs > 0){
+        fprintf(stderr, "arena: %zu allocations, %zu bytes this line\n",
+                arena->num_allocs, arena->num_bytes);
+    }
+    arena->num_allocs = 0;
+    arena->num_bytes = 0;
+    #endif
+
+    if (arena->first != NULL){
+        arena->first->used = 0;
+    }
+    arena->current = arena->first;
+}
+
+
+void arena_free(Arena *arena){
+    ArenaBlock *block = arena->first;
+    while (block != NULL){
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    memset(arena, 0, sizeof(Arena));
+}
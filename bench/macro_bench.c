@@ -0,0 +1,285 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+/*
+** Macrobenchmarks: runs the shell binary on generated scripts.
+**
+**   script      N-line scripts of builtins (echo, assignments) and of
+**               external commands (true), per line
+**   pipeline    echo | cat | ... | cat with DEPTH cats, per pipeline
+**   throughput  head -c BYTES /dev/zero | cat > /dev/null, in GB/s
+**   status      a script that prints $? after external commands, run
+**               serially and with -j 4; fails unless both print the same
+**   background  cat /dev/zero | sleep 1 & with the cat builtin at its
+**               head; fails unless the shell is done well before the
+**               second it would take if the line held the shell up.
+**               Also fails unless false & is a job that wait $! finds
+**
+** Usage: macro_bench [-n LINES] [-m MB] [SHELL]
+**
+** SHELL defaults to ./cscshell. Each run gets an init file that only
+** sets PATH, and the script's output goes to /dev/null. Prints one
+** key=value line per measurement.
+*/
+
+#include "../cscshell.h"
+
+#include <spawn.h>
+
+static const int depths[] = {1, 8, 32};
+static char dir[] = "/tmp/macro_bench.XXXXXX";
+static char init_file[64];
+static char script_file[64];
+
+static double now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static FILE *open_script(){
+    FILE *script = fopen(script_file, "w");
+    if (script == NULL){
+        perror(script_file);
+        exit(EXIT_FAILURE);
+    }
+    return script;
+}
+
+/*
+** Runs shell on the script, with -j jobs unless jobs is NULL and its
+** output going to out, and returns how long it took.
+*/
+static double run_shell_to(const char *shell, char *jobs, const char *out){
+    char *args[] = {(char *) shell, "-i", init_file, script_file, NULL, NULL, NULL};
+    if (jobs != NULL){
+        memmove(args + 3, args + 1, 3 * sizeof(char *));
+        args[1] = "-j";
+        args[2] = jobs;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, out,
+                                     O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    double start = now_us();
+    pid_t pid;
+    int err = posix_spawn(&pid, shell, &actions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0){
+        fprintf(stderr, "macro_bench: %s: %s\n", shell, strerror(err));
+        exit(EXIT_FAILURE);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    double total = now_us() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 1){
+        fprintf(stderr, "macro_bench: %s failed on %s\n", shell, script_file);
+        exit(EXIT_FAILURE);
+    }
+    return total;
+}
+
+static double run_shell(const char *shell){
+    return run_shell_to(shell, NULL, "/dev/null");
+}
+
+static void bench_script(const char *shell, long lines){
+    FILE *script = open_script();
+    for (long i = 0; i < lines; i += 2){
+        fprintf(script, "X=%ld\necho line $X\n", i);
+    }
+    fclose(script);
+    double total = run_shell(shell);
+    printf("bench=script case=builtin lines=%ld total_us=%.0f per_line_us=%.2f\n",
+           lines, total, total / lines);
+
+    // external commands cost a launch each, so there are fewer of them
+    // (true alone would be the builtin)
+    long external = lines / 100 > 0 ? lines / 100 : 1;
+    script = open_script();
+    for (long i = 0; i < external; i++){
+        fprintf(script, "/bin/true\n");
+    }
+    fclose(script);
+    total = run_shell(shell);
+    printf("bench=script case=external lines=%ld total_us=%.0f per_line_us=%.2f\n",
+           external, total, total / external);
+}
+
+static void bench_pipeline(const char *shell){
+    const int runs = 20;
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++){
+        FILE *script = open_script();
+        for (int r = 0; r < runs; r++){
+            fprintf(script, "echo hello");
+            for (int i = 0; i < depths[d]; i++){
+                fprintf(script, " | cat");
+            }
+            fprintf(script, "\n");
+        }
+        fclose(script);
+        double total = run_shell(shell);
+        printf("bench=pipeline depth=%d runs=%d total_us=%.0f per_run_us=%.1f\n",
+               depths[d], runs, total, total / runs);
+    }
+}
+
+static void bench_throughput(const char *shell, long mb){
+    long long bytes = (long long) mb << 20;
+    FILE *script = open_script();
+    fprintf(script, "head -c %lld /dev/zero | cat > /dev/null\n", bytes);
+    fclose(script);
+    double total = run_shell(shell);
+    printf("bench=throughput bytes=%lld total_us=%.0f gb_per_s=%.3f\n",
+           bytes, total, bytes / (total * 1e3));
+}
+
+static char *read_output(const char *path){
+    FILE *file = fopen(path, "r");
+    if (file == NULL){
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    rewind(file);
+    char *text = calloc(len + 1, 1);
+    if (text == NULL || fread(text, 1, len, file) != (size_t) len){
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    return text;
+}
+
+// the last line started before each echo sets $?, not the last to finish
+static void bench_status(const char *shell){
+    const int groups = 50;
+    FILE *script = open_script();
+    for (int g = 0; g < groups; g++){
+        fprintf(script, "/bin/true\n");
+        fprintf(script, "/bin/sh -c \"sleep 0.00%d; exit %d\"\n", g % 5, g % 7);
+        fprintf(script, "/bin/sh -c \"exit %d\"\n", g % 3);
+        fprintf(script, "echo st=$?\n");
+    }
+    fclose(script);
+
+    char serial_out[64];
+    char parallel_out[64];
+    snprintf(serial_out, sizeof(serial_out), "%s/serial", dir);
+    snprintf(parallel_out, sizeof(parallel_out), "%s/parallel", dir);
+    run_shell_to(shell, NULL, serial_out);
+    double total = run_shell_to(shell, "4", parallel_out);
+
+    char *serial = read_output(serial_out);
+    char *parallel = read_output(parallel_out);
+    int match = strcmp(serial, parallel) == 0;
+    printf("bench=status jobs=4 lines=%d total_us=%.0f match=%s\n",
+           groups * 4, total, match ? "yes" : "no");
+    free(serial);
+    free(parallel);
+    unlink(serial_out);
+    unlink(parallel_out);
+    if (!match){
+        fprintf(stderr, "macro_bench: $? differs between -j 4 and a serial run\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void bench_background(const char *shell){
+    FILE *script = open_script();
+    fprintf(script, "cat /dev/zero | sleep 1 &\n");
+    fprintf(script, "echo next\n");
+    fclose(script);
+    double total = run_shell(shell);
+    printf("bench=background case=cat_head total_us=%.0f\n", total);
+    if (total >= 500000){
+        fprintf(stderr, "macro_bench: a background line held the shell for %.0f us\n",
+                total);
+        exit(EXIT_FAILURE);
+    }
+
+    // a forked builtin must not hold its own pipe open: cat only stops
+    // once head has gone, and the shell waits for it (or is killed)
+    script = open_script();
+    fprintf(script, "cat /dev/zero | head -c 1 >/dev/null &\n");
+    fprintf(script, "wait\n");
+    fclose(script);
+    alarm(5);
+    total = run_shell(shell);
+    alarm(0);
+    printf("bench=background case=cat_wait total_us=%.0f\n", total);
+
+    // a line of nothing but a builtin is a job like any other
+    script = open_script();
+    fprintf(script, "false &\n");
+    fprintf(script, "wait $!\n");
+    fprintf(script, "echo st=$?\n");
+    fclose(script);
+    char out_file[64];
+    snprintf(out_file, sizeof(out_file), "%s/jobs", dir);
+    run_shell_to(shell, NULL, out_file);
+    char *out = read_output(out_file);
+    int match = strcmp(out, "st=1\n") == 0;
+    printf("bench=background case=builtin_job match=%s\n", match ? "yes" : "no");
+    free(out);
+    unlink(out_file);
+    if (!match){
+        fprintf(stderr, "macro_bench: false & was not a job for wait $!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[]){
+    long lines = 100000;
+    long mb = 1024;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1){
+        switch (opt){
+        case 'n':
+            lines = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            mb = strtol(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n LINES] [-m MB] [SHELL]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (lines < 2 || mb < 1){
+        fprintf(stderr, "Usage: %s [-n LINES] [-m MB] [SHELL]\n", argv[0]);
+        return 1;
+    }
+    const char *shell = optind < argc ? argv[optind] : "./cscshell";
+
+    if (mkdtemp(dir) == NULL){
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(init_file, sizeof(init_file), "%s/init", dir);
+    snprintf(script_file, sizeof(script_file), "%s/script", dir);
+    FILE *init = fopen(init_file, "w");
+    if (init == NULL){
+        perror(init_file);
+        return 1;
+    }
+    fprintf(init, "PATH=/usr/bin:/bin\n");
+    fclose(init);
+
+    bench_script(shell, lines);
+    bench_pipeline(shell);
+    bench_throughput(shell, mb);
+    bench_status(shell);
+    bench_background(shell);
+
+    unlink(script_file);
+    unlink(init_file);
+    rmdir(dir);
+    return 0;
+}
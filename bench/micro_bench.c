@@ -0,0 +1,228 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+/*
+** Microbenchmarks of the shell's per-line work, run in process:
+**
+**   parse    compile_line on a short and a long line (what a parse
+**            cache miss costs), and parse_line on the same lines (a
+**            hit: the cached template filled in)
+**   expand   replace_variables_mk_line and instantiate_line on a long
+**            line that uses many variables
+**   resolve  resolve_executable and hash_resolve against synthetic PATH
+**            directories of 10k entries each, looking up the last entry
+**            of the last directory
+**
+** Usage: micro_bench [-n ITERATIONS] [-e ENTRIES]
+**
+** Prints one key=value line per measurement.
+*/
+
+#include "../cscshell.h"
+
+#define NUM_VARS 256
+#define NUM_PATH_DIRS 4
+
+static double now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void report(const char *bench, const char *name, long iterations, double total){
+    printf("bench=%s case=%s iterations=%ld total_us=%.0f per_op_ns=%.1f\n",
+           bench, name, iterations, total, total * 1000 / iterations);
+}
+
+// a variable name made of letters only, as the shell requires
+static void var_name(char *out, int i){
+    out[0] = 'V';
+    out[1] = 'a' + i / 26 % 26;
+    out[2] = 'a' + i % 26;
+    out[3] = '\0';
+}
+
+static char *repeat_line(const char *prefix, const char *piece, int count){
+    size_t len = strlen(prefix) + strlen(piece) * count + 1;
+    char *line = malloc(len);
+    if (line == NULL){
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(line, prefix);
+    for (int i = 0; i < count; i++){
+        strcat(line, piece);
+    }
+    return line;
+}
+
+static void bench_parse(VarTable *vars, long iterations){
+    const char *short_line = "grep -n \"$X\" notes.txt | sort -k2 | uniq -c > counts.txt";
+    char *long_line = repeat_line("echo", " word 'quoted text' \"$X\"", 100);
+    const char *lines[] = {short_line, long_line};
+    const char *names[] = {"short", "long"};
+    char name[64];
+
+    for (size_t l = 0; l < 2; l++){
+        Arena arena = {0};
+        double start = now_us();
+        for (long i = 0; i < iterations; i++){
+            if (compile_line(lines[l], &arena) == (LineTemplate *) -1){
+                fprintf(stderr, "micro_bench: could not compile %s\n", lines[l]);
+                exit(EXIT_FAILURE);
+            }
+            arena_reset(&arena);
+        }
+        snprintf(name, sizeof(name), "compile_%s", names[l]);
+        report("parse", name, iterations, now_us() - start);
+
+        char *line = strdup(lines[l]);
+        start = now_us();
+        for (long i = 0; i < iterations; i++){
+            if (parse_line(line, vars, &arena) == (Command *) -1){
+                fprintf(stderr, "micro_bench: could not parse %s\n", lines[l]);
+                exit(EXIT_FAILURE);
+            }
+            arena_reset(&arena);
+        }
+        snprintf(name, sizeof(name), "parse_line_%s", names[l]);
+        report("parse", name, iterations, now_us() - start);
+        free(line);
+        arena_free(&arena);
+    }
+    free(long_line);
+}
+
+static void bench_expand(VarTable *vars, long iterations){
+    char name[8];
+    char value[32];
+    size_t len = strlen("echo") + NUM_VARS * 8 + 1;
+    char *line = malloc(len);
+    if (line == NULL){
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(line, "echo");
+    for (int i = 0; i < NUM_VARS; i++){
+        var_name(name, i);
+        snprintf(value, sizeof(value), "value-%d", i);
+        vars_set(vars, name, value);
+        strcat(line, " $");
+        strcat(line, name);
+    }
+
+    double start = now_us();
+    for (long i = 0; i < iterations; i++){
+        free(replace_variables_mk_line(line, vars));
+    }
+    report("expand", "replace_variables_mk_line", iterations, now_us() - start);
+
+    Arena arena = {0};
+    LineTemplate *tmpl = parse_cache_get(line);
+    start = now_us();
+    for (long i = 0; i < iterations; i++){
+        instantiate_line(tmpl, vars, &arena);
+        arena_reset(&arena);
+    }
+    report("expand", "instantiate_line", iterations, now_us() - start);
+    arena_free(&arena);
+    free(line);
+}
+
+static void bench_resolve(long iterations, long entries){
+    char root[] = "/tmp/micro_bench.XXXXXX";
+    if (mkdtemp(root) == NULL){
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+
+    char path[NUM_PATH_DIRS * 64] = "";
+    char file[256];
+    for (int d = 0; d < NUM_PATH_DIRS; d++){
+        snprintf(file, sizeof(file), "%s/bin%d", root, d);
+        mkdir(file, 0755);
+        for (long e = 0; e < entries; e++){
+            snprintf(file, sizeof(file), "%s/bin%d/cmd%d_%ld", root, d, d, e);
+            int fd = open(file, O_WRONLY | O_CREAT, 0755);
+            if (fd == -1){
+                perror(file);
+                exit(EXIT_FAILURE);
+            }
+            close(fd);
+        }
+        snprintf(path + strlen(path), sizeof(path) - strlen(path), "%s%s/bin%d",
+                 d ? ":" : "", root, d);
+    }
+    Variable path_var = {.name = PATH_VAR_NAME, .value = path};
+    char target[64];
+    snprintf(target, sizeof(target), "cmd%d_%ld", NUM_PATH_DIRS - 1, entries - 1);
+
+    // a PATH walk reads every directory, so fewer rounds do
+    long walks = iterations / 1000 > 0 ? iterations / 1000 : 1;
+    double start = now_us();
+    for (long i = 0; i < walks; i++){
+        free(resolve_executable(target, &path_var));
+    }
+    report("resolve", "resolve_executable", walks, now_us() - start);
+
+    start = now_us();
+    free(hash_resolve(target, &path_var));
+    report("resolve", "hash_resolve_first", 1, now_us() - start);
+
+    start = now_us();
+    for (long i = 0; i < iterations; i++){
+        free(hash_resolve(target, &path_var));
+    }
+    report("resolve", "hash_resolve_cached", iterations, now_us() - start);
+    hash_free();
+
+    for (int d = 0; d < NUM_PATH_DIRS; d++){
+        for (long e = 0; e < entries; e++){
+            snprintf(file, sizeof(file), "%s/bin%d/cmd%d_%ld", root, d, d, e);
+            unlink(file);
+        }
+        snprintf(file, sizeof(file), "%s/bin%d", root, d);
+        rmdir(file);
+    }
+    rmdir(root);
+}
+
+int main(int argc, char *argv[]){
+    long iterations = 100000;
+    long entries = 10000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:e:")) != -1){
+        switch (opt){
+        case 'n':
+            iterations = strtol(optarg, NULL, 10);
+            break;
+        case 'e':
+            entries = strtol(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n ITERATIONS] [-e ENTRIES]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (iterations < 1 || entries < 1){
+        fprintf(stderr, "Usage: %s [-n ITERATIONS] [-e ENTRIES]\n", argv[0]);
+        return 1;
+    }
+
+    VarTable vars = {0};
+    set_builtin_variables(&vars);
+    vars_set(&vars, PATH_VAR_NAME, "/usr/bin:/bin");
+    vars_set(&vars, "X", "pattern");
+
+    bench_parse(&vars, iterations);
+    bench_expand(&vars, iterations);
+    bench_resolve(iterations, entries);
+
+    vars_free(&vars);
+    hash_free();
+    parse_cache_clear();
+    return 0;
+}
@@ -0,0 +1,98 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+/*
+** fork vs posix_spawn vs zygote: times run_command + waitpid for each
+** LaunchMode.
+**
+** Usage: spawn_bench [-n ITERATIONS] [-m BALLAST_MB] [EXECUTABLE]
+**
+** BALLAST_MB of touched heap is allocated first to stand in for a shell
+** that has grown caches and history; fork gets slower as it grows,
+** spawn and the zygote (started before the ballast) should not. Prints
+** one key=value line per mode.
+*/
+
+#include "../cscshell.h"
+
+#include <time.h>
+
+static double now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double time_mode(LaunchMode mode, Command *cmd, long iterations){
+    set_launch_mode(mode);
+    double start = now_us();
+    for (long i = 0; i < iterations; i++){
+        int pid = run_command(cmd);
+        if (pid <= 0){
+            fprintf(stderr, "spawn_bench: could not start %s\n", cmd->exec_path);
+            exit(EXIT_FAILURE);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return now_us() - start;
+}
+
+int main(int argc, char *argv[]){
+    long iterations = 1000;
+    long ballast_mb = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1){
+        switch (opt){
+        case 'n':
+            iterations = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            ballast_mb = strtol(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n ITERATIONS] [-m BALLAST_MB] [EXECUTABLE]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    char *exec_path = optind < argc ? argv[optind] : "/bin/true";
+    char *args[] = {exec_path, NULL};
+    Command cmd = {
+        .exec_path = exec_path,
+        .args = args,
+        .stdin_fd = STDIN_FILENO,
+        .stdout_fd = STDOUT_FILENO,
+    };
+
+    if (zygote_start() < 0){
+        return 1;
+    }
+
+    char *ballast = NULL;
+    if (ballast_mb > 0){
+        size_t len = (size_t) ballast_mb << 20;
+        ballast = malloc(len);
+        if (ballast == NULL){
+            perror("malloc");
+            return 1;
+        }
+        memset(ballast, 1, len);
+    }
+
+    const LaunchMode modes[] = {LAUNCH_FORK, LAUNCH_SPAWN, LAUNCH_ZYGOTE};
+    const char *names[] = {"fork", "spawn", "zygote"};
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++){
+        double total = time_mode(modes[m], &cmd, iterations);
+        printf("bench=spawn mode=%s iterations=%ld ballast_mb=%ld "
+               "total_us=%.0f per_launch_us=%.2f\n", names[m], iterations,
+               ballast_mb, total, total / iterations);
+    }
+
+    zygote_stop();
+    free(ballast);
+    return 0;
+}
@@ -0,0 +1,337 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+#include <signal.h>
+#include <sys/sendfile.h>
+
+/*
+** The cat and tee builtins. They run in the shell on the pipe ends and
+** redirections start_line and run_builtin give them, and move data in
+** the kernel where the fds allow it:
+**
+**     file -> file    copy_file_range
+**     any  -> pipe    splice (and pipe -> any)
+**     file -> other   sendfile (sockets, among others)
+**
+** tee duplicates its input into a pipe with tee(2) before splicing it
+** on to a single file. Whatever the kernel refuses (EINVAL, ENOSYS,
+** EXDEV, ...: an append-mode file, a filesystem without support) falls
+** back to read/write from wherever the copy got to.
+**
+** cat with options it does not know, and tee with any option but -a,
+** run the cat or tee on PATH instead.
+*/
+
+#define COPY_CHUNK (1 << 16)
+
+typedef enum CopyMethod {
+    COPY_READ_WRITE,
+    COPY_FILE_RANGE,
+    COPY_SPLICE,
+    COPY_SENDFILE
+} CopyMethod;
+
+static CopyMethod choose_method(int in_fd, int out_fd){
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1){
+        return COPY_READ_WRITE;
+    }
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)){
+        return COPY_SPLICE;
+    }
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode) &&
+        !(fcntl(out_fd, F_GETFL) & O_APPEND)){
+        return COPY_FILE_RANGE;
+    }
+    if (S_ISREG(in_st.st_mode)){
+        return COPY_SENDFILE;
+    }
+    return COPY_READ_WRITE;
+}
+
+// errors that mean the method does not apply to these fds
+static int unsupported(int err){
+    return err == EINVAL || err == ENOSYS || err == EXDEV ||
+        err == EOPNOTSUPP || err == EBADF;
+}
+
+static ssize_t write_all(int fd, const char *buf, size_t len){
+    for (size_t off = 0; off < len;){
+        ssize_t n = write(fd, buf + off, len - off);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n < 0){
+            return -1;
+        }
+        off += n;
+    }
+    return len;
+}
+
+static ssize_t read_write(int in_fd, int out_fd){
+    static char buf[COPY_CHUNK];
+    ssize_t n = read(in_fd, buf, sizeof(buf));
+    if (n <= 0){
+        return n;
+    }
+    return write_all(out_fd, buf, n);
+}
+
+
+int copy_fd(int in_fd, int out_fd){
+    CopyMethod method = choose_method(in_fd, out_fd);
+    int moved = 0;
+
+    for (;;){
+        ssize_t n = 0;
+        switch (method){
+        case COPY_FILE_RANGE:
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0);
+            break;
+        case COPY_SPLICE:
+            n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+            break;
+        case COPY_SENDFILE:
+            n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK);
+            break;
+        case COPY_READ_WRITE:
+            n = read_write(in_fd, out_fd);
+            break;
+        }
+        if (n == 0){
+            return 0;
+        }
+        if (n > 0){
+            moved = 1;
+            continue;
+        }
+        if (errno == EINTR){
+            continue;
+        }
+        // EBADF only means "not this method" before anything moved
+        if (method != COPY_READ_WRITE && unsupported(errno) &&
+            (errno != EBADF || !moved)){
+            method = COPY_READ_WRITE;
+            continue;
+        }
+        return -1;
+    }
+}
+
+// status for a failed copy: quiet on a reader that went away
+static int copy_failed(const char *name){
+    if (errno == EPIPE){
+        return 128 + SIGPIPE;
+    }
+    perror(name);
+    return 1;
+}
+
+/*
+** Runs the name on PATH with args, reading in_fd and writing out_fd,
+** for the options the builtins leave to it. Returns its status.
+*/
+static int run_external(const char *name, char **args, int in_fd, int out_fd){
+    VarTable *vars = builtin_variables();
+    char *resolved = hash_resolve(name, vars ? vars->path : NULL);
+    if (resolved == NULL){
+        ERR_PRINT(ERR_NO_EXECU, name);
+        return 127;
+    }
+
+    Command command;
+    memset(&command, 0, sizeof(Command));
+    command.exec_path = resolved;
+    command.args = args;
+    command.stdin_fd = in_fd;
+    command.stdout_fd = out_fd;
+    pid_t pid = run_command(&command);
+    free(resolved);
+    if (pid <= 0){
+        return 1;
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR){}
+    trace_child_exited(pid, status);
+    return status_to_exit_code(status);
+}
+
+
+// cat [-u] [FILE]...: - or no files at all copy the input
+int cat_builtin(char **args, int in_fd, int out_fd){
+    size_t a = 1;
+    for (; args[a] != NULL && args[a][0] == '-' && args[a][1] != '\0'; a++){
+        if (strcmp(args[a], "--") == 0){
+            a++;
+            break;
+        }
+        // -u (unbuffered) is what cat does here anyway
+        if (strcmp(args[a], "-u") != 0){
+            return run_external("cat", args, in_fd, out_fd);
+        }
+    }
+
+    if (args[a] == NULL){
+        return copy_fd(in_fd, out_fd) < 0 ? copy_failed("cat") : 0;
+    }
+
+    int ret = 0;
+    for (; args[a] != NULL; a++){
+        int fd = in_fd;
+        if (strcmp(args[a], "-") != 0 &&
+            (fd = open(args[a], O_RDONLY | O_CLOEXEC)) == -1){
+            fprintf(stderr, "cat: %s: %s\n", args[a], strerror(errno));
+            ret = 1;
+            continue;
+        }
+        int copied = copy_fd(fd, out_fd);
+        int err = errno;
+        if (fd != in_fd){
+            close(fd);
+        }
+        if (copied < 0){
+            errno = err;
+            if (err == EPIPE){
+                return 128 + SIGPIPE;
+            }
+            fprintf(stderr, "cat: %s: %s\n", args[a], strerror(err));
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+
+// pipe to pipe and a file that splice can write to
+static int can_tee(int in_fd, int out_fd, int file_fd){
+    struct stat in_st, out_st, file_st;
+    return fstat(in_fd, &in_st) == 0 && S_ISFIFO(in_st.st_mode) &&
+        fstat(out_fd, &out_st) == 0 && S_ISFIFO(out_st.st_mode) &&
+        fstat(file_fd, &file_st) == 0 && S_ISREG(file_st.st_mode) &&
+        !(fcntl(file_fd, F_GETFL) & O_APPEND);
+}
+
+/*
+** One chunk of tee from a pipe to out_fd (also a pipe) and one file,
+** without the data leaving the kernel: tee(2) copies what is in the
+** input pipe to out_fd, then the same bytes are spliced on to the file,
+** which consumes them. Returns the bytes moved, 0 at the end of input.
+*/
+static ssize_t tee_chunk(int in_fd, int out_fd, int file_fd){
+    ssize_t n;
+    while ((n = tee(in_fd, out_fd, COPY_CHUNK, 0)) == -1 && errno == EINTR){}
+    if (n <= 0){
+        return n;
+    }
+    for (ssize_t left = n; left > 0;){
+        ssize_t m = splice(in_fd, NULL, file_fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (m < 0 && errno == EINTR){
+            continue;
+        }
+        if (m <= 0){
+            return -1;
+        }
+        left -= m;
+    }
+    return n;
+}
+
+// read/write tee from wherever the input got to
+static int tee_read_write(int in_fd, int out_fd, int *fds, size_t num_fds,
+                          char **names){
+    static char buf[COPY_CHUNK];
+    int ret = 0;
+    int out_ok = 1;
+    for (;;){
+        ssize_t n = read(in_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n < 0){
+            perror("tee");
+            return 1;
+        }
+        if (n == 0){
+            return ret;
+        }
+        // like tee, carry on for the files when the reader goes away
+        if (out_ok && write_all(out_fd, buf, n) < 0){
+            out_ok = 0;
+            ret = copy_failed("tee");
+        }
+        for (size_t f = 0; f < num_fds; f++){
+            if (fds[f] != -1 && write_all(fds[f], buf, n) < 0){
+                fprintf(stderr, "tee: %s: %s\n", names[f], strerror(errno));
+                fds[f] = -1;
+                ret = 1;
+            }
+        }
+    }
+}
+
+// tee [-a] [FILE]...: the input goes to the output and every file
+int tee_builtin(char **args, int in_fd, int out_fd){
+    size_t a = 1;
+    int append = 0;
+    for (; args[a] != NULL && args[a][0] == '-' && args[a][1] != '\0'; a++){
+        if (strcmp(args[a], "--") == 0){
+            a++;
+            break;
+        }
+        if (strcmp(args[a], "-a") != 0){
+            return run_external("tee", args, in_fd, out_fd);
+        }
+        append = 1;
+    }
+
+    size_t num_files = 0;
+    while (args[a + num_files] != NULL){
+        num_files++;
+    }
+    int *fds = malloc((num_files + 1) * sizeof(int));
+    if (fds == NULL){
+        perror("tee");
+        return 1;
+    }
+    int ret = 0;
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+    for (size_t f = 0; f < num_files; f++){
+        fds[f] = open(args[a + f], flags, 0644);
+        if (fds[f] == -1){
+            fprintf(stderr, "tee: %s: %s\n", args[a + f], strerror(errno));
+            ret = 1;
+        }
+    }
+
+    int status;
+    if (num_files == 0){
+        status = copy_fd(in_fd, out_fd) < 0 ? copy_failed("tee") : 0;
+    }
+    else if (num_files == 1 && fds[0] != -1 && can_tee(in_fd, out_fd, fds[0])){
+        ssize_t n;
+        while ((n = tee_chunk(in_fd, out_fd, fds[0])) > 0){}
+        status = n < 0 ? copy_failed("tee") : 0;
+        // like tee, the file still gets the rest once the reader is gone
+        if (n < 0 && errno == EPIPE && copy_fd(in_fd, fds[0]) < 0){
+            perror(args[a]);
+            ret = 1;
+        }
+    }
+    else {
+        status = tee_read_write(in_fd, out_fd, fds, num_files, args + a);
+    }
+
+    for (size_t f = 0; f < num_files; f++){
+        if (fds[f] != -1){
+            close(fds[f]);
+        }
+    }
+    free(fds);
+    return ret ? ret : status;
+}
@@ -12,56 +12,102 @@ void print_help(){
     printf("Options:\n");
     printf("  -h, --help\t\t\tDisplay this help message\n");
     printf("  -i, --init-file=FILE\t\tUse a specific init file. Default is ~/.cscshell_init\n");
+    printf("      --path-index[=FILE]\tKeep a persistent index of PATH directories.\n");
+    printf("\t\t\t\tDefault is $XDG_CACHE_HOME/cscshell/pathidx\n");
+    printf("      --script-cache[=DIR]\tKeep compiled copies of scripts that have run.\n");
+    printf("\t\t\t\tDefault is $XDG_CACHE_HOME/cscshell/scripts\n");
+    printf("      --init-snapshot[=DIR]\tLoad the variables of an init file of only\n");
+    printf("\t\t\t\tassignments from a snapshot.\n");
+    printf("\t\t\t\tDefault is $XDG_CACHE_HOME/cscshell/init\n");
+    printf("  -j N\t\t\t\tRun up to N independent script lines at once\n");
+    printf("      --trace=FILE\t\tWrite a Chrome trace of the shell's work to FILE\n");
+    printf("      --pipe-size=BYTES\t\tSize of each pipe between pipeline stages\n");
+    printf("      --launch=fork|spawn|zygote\tHow to start commands. Default is %s\n",
+           DEFAULT_LAUNCH == LAUNCH_SPAWN ? "spawn" : "fork");
+    printf("      --serve=SOCKET\t\tRun the init file, then run scripts for clients\n");
+    printf("\t\t\t\tconnecting to SOCKET\n");
+    printf("      --client=SOCKET\t\tHave the server at SOCKET run the script, the\n");
+    printf("\t\t\t\t-c command or stdin\n");
+    printf("  -c COMMAND\t\t\tWith --client, run COMMAND instead of a script\n");
     printf("If no script file is given, cscshell will run in interactive mode\n");
 }
 
 
-char *prompt(char *line, size_t line_length){
-    char cwd_buff[MAX_PATH_STR];
-    if (getcwd(cwd_buff, MAX_PATH_STR) == NULL){
+char *prompt(VarTable *root, char *line, size_t line_length){
+    if (prompt_write(root) < 0){
         perror("prompt:");
         return (char *) -1;
     }
-
-    char user_buff[MAX_USER_BUF];
-    if (getlogin_r(user_buff, MAX_USER_BUF)){
-        perror("prompt:");
-        return (char *) -1;
-    }
-
-    printf("%s@<%s> %s", user_buff, cwd_buff, PROMPT_STR);
     return fgets(line, line_length, stdin);
 }
 
 
-int run_interactive(Variable **root){
+// the rest of a block typed at the prompt, NULL at the end of input
+static char *continuation_line(void *source){
+    static char line[MAX_SINGLE_LINE];
+    (void) source;
+    printf("> ");
+    fflush(stdout);
+    if (fgets(line, MAX_SINGLE_LINE, stdin) == NULL){
+        return NULL;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    return line;
+}
+
+int run_interactive(VarTable *root){
     long error;
     char line[MAX_SINGLE_LINE];
+    Arena arena = {0};
 
     #ifdef DEBUG
     printf("Interactive CSCSHELL starting...\n");
     #endif
 
-    while ((error = (long) prompt(line, MAX_SINGLE_LINE)) > 0) {
+    while ((error = (long) prompt(root, line, MAX_SINGLE_LINE)) > 0) {
         // kill the newline
         line[strlen(line) - 1] = '\0';
 
-        Command *commands = parse_line(line, root);
+        if (is_block_line(line)){
+            if (run_block(line, continuation_line, NULL, root) == 0){
+                break;
+            }
+            continue;
+        }
+
+        Command *commands = parse_line(line, root, &arena);
         if (commands == (Command *) -1){
             ERR_PRINT(ERR_PARSING_LINE);
+            arena_reset(&arena);
+            continue;
+        }
+        // an assignment still allocated from the arena
+        if (commands == NULL){
+            arena_reset(&arena);
             continue;
         }
-        if (commands == NULL) continue;
 
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
         int *last_ret_code_pt = execute_line(commands);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        arena_reset(&arena);
         if (last_ret_code_pt == (int *) -1){
             ERR_PRINT(ERR_EXECUTE_LINE);
-            free(last_ret_code_pt);
+            arena_free(&arena);
             return -1;
         }
+        prompt_line_done(last_ret_code_pt ? *last_ret_code_pt : 0,
+                         (end.tv_sec - start.tv_sec) * 1000000L +
+                         (end.tv_nsec - start.tv_nsec) / 1000);
         free(last_ret_code_pt);
+
+        if (exit_requested(NULL)){
+            break;
+        }
     }
     printf("\n");
+    arena_free(&arena);
 
     #ifdef DEBUG
     printf("\nInteractive CSCSHELL exiting...\n");
@@ -72,10 +118,38 @@ int run_interactive(Variable **root){
 }
 
 
+/*
+** Where cache files (the PATH index, compiled scripts) live when no
+** location is given: $XDG_CACHE_HOME/name, falling back to ~/.cache.
+** Returns a heap string, or NULL if neither variable is set.
+*/
+char *default_cache_path(const char *name){
+    char *base = getenv("XDG_CACHE_HOME");
+    const char *suffix = "";
+    if (base == NULL || *base == '\0'){
+        base = getenv("HOME");
+        suffix = "/.cache";
+    }
+    if (base == NULL){
+        return NULL;
+    }
+    size_t len = strlen(base) + strlen(suffix) + strlen(name) + 2;
+    char *file = malloc(len);
+    if (file != NULL){
+        snprintf(file, len, "%s%s/%s", base, suffix, name);
+    }
+    return file;
+}
+
+
 int main(int argc, char *argv[]){
 
     int num_args_parsed = 0;
     char *init_file = DEFAULT_INIT;
+    int launch_zygote = 0;
+    char *serve_socket = NULL;
+    char *client_socket = NULL;
+    char *command = NULL;
 
     for (int i=1; i < argc; i++){
         if (strcmp(argv[i], "-h") == 0 ||
@@ -101,31 +175,184 @@ int main(int argc, char *argv[]){
             num_args_parsed++;
             init_file = strchr(argv[1], '=') + 1;
         }
+
+        else if (strcmp(argv[i], "-j") == 0){
+            if (i + 1 >= argc){
+                fprintf(stderr, ERR_ARGS_MISSING_J);
+                return -1;
+            }
+            char *end;
+            long jobs = strtol(argv[i + 1], &end, 10);
+            if (*end != '\0' || jobs < 1 || jobs > MAX_PARALLEL_JOBS){
+                ERR_PRINT(ERR_JOBS, argv[i + 1]);
+                return -1;
+            }
+            set_parallel_jobs(jobs);
+            i++;
+            num_args_parsed += 2;
+        }
+
+        else if (strncmp(argv[i], LONG_PIPESZ_ARG,
+                         strlen(LONG_PIPESZ_ARG)) == 0){
+            num_args_parsed++;
+            char *end;
+            long bytes = strtol(argv[i] + strlen(LONG_PIPESZ_ARG), &end, 10);
+            if (*end != '\0' || bytes <= 0 || bytes > INT32_MAX){
+                ERR_PRINT(ERR_PIPE_SIZE, argv[i] + strlen(LONG_PIPESZ_ARG));
+                return -1;
+            }
+            set_pipe_size((int) bytes);
+        }
+
+        else if (strncmp(argv[i], LONG_LAUNCH_ARG,
+                         strlen(LONG_LAUNCH_ARG)) == 0){
+            num_args_parsed++;
+            const char *mode = argv[i] + strlen(LONG_LAUNCH_ARG);
+            if (strcmp(mode, "fork") == 0){
+                set_launch_mode(LAUNCH_FORK);
+            }
+            else if (strcmp(mode, "spawn") == 0){
+                set_launch_mode(LAUNCH_SPAWN);
+            }
+            else if (strcmp(mode, "zygote") == 0){
+                set_launch_mode(LAUNCH_ZYGOTE);
+                launch_zygote = 1;
+            }
+            else {
+                ERR_PRINT(ERR_LAUNCH_MODE, mode);
+                return -1;
+            }
+        }
+
+        else if (strcmp(argv[i], "-c") == 0){
+            if (i + 1 >= argc){
+                fprintf(stderr, ERR_ARGS_MISSING_C);
+                return -1;
+            }
+            command = argv[i + 1];
+            i++;
+            num_args_parsed += 2;
+        }
+
+        else if (strncmp(argv[i], LONG_SERVE_ARG,
+                         strlen(LONG_SERVE_ARG)) == 0){
+            num_args_parsed++;
+            serve_socket = argv[i] + strlen(LONG_SERVE_ARG);
+        }
+
+        else if (strncmp(argv[i], LONG_CLIENT_ARG,
+                         strlen(LONG_CLIENT_ARG)) == 0){
+            num_args_parsed++;
+            client_socket = argv[i] + strlen(LONG_CLIENT_ARG);
+        }
+
+        else if (strncmp(argv[i], LONG_TRACE_ARG,
+                         strlen(LONG_TRACE_ARG)) == 0){
+            num_args_parsed++;
+            if (trace_open(argv[i] + strlen(LONG_TRACE_ARG)) < 0){
+                return -1;
+            }
+        }
+
+        else if (strncmp(argv[i], LONG_PATHIDX_ARG,
+                         strlen(LONG_PATHIDX_ARG)) == 0){
+            num_args_parsed++;
+            char *file = argv[i][strlen(LONG_PATHIDX_ARG)] == '=' ?
+                strdup(strchr(argv[i], '=') + 1) : default_cache_path(DEFAULT_PATHIDX);
+            if (file != NULL){
+                pathidx_open(file);
+                free(file);
+            }
+        }
+
+        else if (strncmp(argv[i], LONG_SCRIPTCACHE_ARG,
+                         strlen(LONG_SCRIPTCACHE_ARG)) == 0){
+            num_args_parsed++;
+            char *dir = argv[i][strlen(LONG_SCRIPTCACHE_ARG)] == '=' ?
+                strdup(strchr(argv[i], '=') + 1) : default_cache_path(DEFAULT_SCRIPTCACHE);
+            if (dir != NULL){
+                script_cache_open(dir);
+                free(dir);
+            }
+        }
+
+        else if (strncmp(argv[i], LONG_SNAPSHOT_ARG,
+                         strlen(LONG_SNAPSHOT_ARG)) == 0){
+            num_args_parsed++;
+            char *dir = argv[i][strlen(LONG_SNAPSHOT_ARG)] == '=' ?
+                strdup(strchr(argv[i], '=') + 1) : default_cache_path(DEFAULT_SNAPSHOT);
+            if (dir != NULL){
+                init_snapshot_open(dir);
+                free(dir);
+            }
+        }
+    }
+
+    if (command != NULL && client_socket == NULL){
+        ERR_PRINT(ERR_C_WITHOUT_CLIENT);
+        return -1;
+    }
+
+    // the server did the rest of the startup already
+    if (client_socket != NULL){
+        char *script = num_args_parsed < argc-1 ? argv[argc-1] : NULL;
+        int ret_code = serve_client(client_socket, script, command);
+        trace_close();
+        return ret_code;
     }
 
     #ifdef DEBUG
     printf("Using init file at: %s\n", init_file);
     #endif
 
-    Variable *start_of_vars = NULL;
-    if (run_script(init_file, &start_of_vars) < 0){
+    // the zygote is forked while the shell is still small
+    if (launch_zygote && zygote_start() < 0){
+        set_launch_mode(LAUNCH_SPAWN);
+    }
+
+    VarTable variables = {0};
+    set_builtin_variables(&variables);
+    jobs_init();
+    if (run_init_file(init_file, &variables) < 0){
         ERR_PRINT(ERR_INIT_SCRIPT, init_file);
         return -1;
     }
 
-    if ((start_of_vars == NULL) ||
-        strcmp(start_of_vars->name, PATH_VAR_NAME) > 0) {
-        ERR_PRINT(ERR_PATH_INIT, init_file);
+    // CSCSHELL_TIMING=1 times the lines after the init file
+    char *timing = getenv(TIMING_ENV_VAR);
+    if (timing != NULL && strcmp(timing, "1") == 0) {
+        set_line_timing(1);
     }
 
-    int ret_code;
-    if (num_args_parsed < argc-1){
-        ret_code = run_script(argv[argc-1], &start_of_vars);
+    if (variables.path == NULL) {
+        ERR_PRINT(ERR_PATH_INIT, init_file);
     }
-    else{
-        ret_code = run_interactive(&start_of_vars);
+
+    // an exit in the init file ends the shell before anything else runs,
+    // with the status it asked for
+    int ret_code = 0;
+    if (!exit_requested(&ret_code)){
+        if (serve_socket != NULL){
+            ret_code = serve(serve_socket, &variables);
+        }
+        else if (num_args_parsed < argc-1){
+            ret_code = run_script(argv[argc-1], &variables);
+        }
+        else{
+            ret_code = run_interactive(&variables);
+        }
     }
+    exit_requested(&ret_code);
 
-    free_variable(start_of_vars, NON_ZERO_BYTE);
+    vars_free(&variables);
+    hash_free();
+    jobs_free();
+    prompt_free();
+    pathidx_close();
+    script_cache_close();
+    init_snapshot_close();
+    parse_cache_clear();
+    trace_close();
+    zygote_stop();
     return ret_code;
 }
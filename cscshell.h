@@ -2,16 +2,26 @@
 /*                     CSCSHELL -- CSC209 A3 Winter 2024                     */
 /*                   Copyright 2024 -- Demetres Kostas PhD                   */
 /*                  ----------------------------------------                 */
-/*                    See also: cscshell.c, parse.c, run.c                   */
+/*           See also: cscshell.c, parse.c, lex.c, parsecache.c,             */
+/*         run.c, vars.c, arena.c, hash.c, pathidx.c, scriptcache.c,         */
+/*              reader.c, jobs.c, parallel.c, par.c, prompt.c,               */
+/*              trace.c, copy.c, zygote.c, serve.c, snapshot.c,              */
+/*                              subst.c, flow.c                              */
 /*****************************************************************************/
 
 
 #ifndef CSCSHELL_H
 #define CSCSHELL_H
 
+// pipe2, F_SETPIPE_SZ and environ
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <ctype.h>
@@ -24,23 +34,48 @@
 #include <dirent.h>
 #include <pwd.h>
 #include <errno.h>
+#include <time.h>
 
 // Arg help
 #define LONG_HELP_ARG "--help"
 #define LONG_INIT_ARG "--init-file="
 #define DEFAULT_INIT "~/.cscshell_init"
+#define LONG_PATHIDX_ARG "--path-index"
+#define LONG_PIPESZ_ARG "--pipe-size="
+#define LONG_LAUNCH_ARG "--launch="
+#define LONG_SCRIPTCACHE_ARG "--script-cache"
+#define LONG_SNAPSHOT_ARG "--init-snapshot"
+#define LONG_TRACE_ARG "--trace="
+#define LONG_SERVE_ARG "--serve="
+#define LONG_CLIENT_ARG "--client="
+#define DEFAULT_PATHIDX "cscshell/pathidx"
+#define DEFAULT_SCRIPTCACHE "cscshell/scripts"
+#define DEFAULT_SNAPSHOT "cscshell/init"
 
 // Buffer sizes
 #define MAX_USER_BUF 128
 #define MAX_PATH_STR 4096
 #define MAX_SINGLE_LINE 4096
+#define READER_BUF_SIZE 65536
+#define HASH_INIT_SLOTS 64
+#define VARS_INIT_SLOTS 64
+#define ARENA_BLOCK_SIZE 8192
+#define PARSE_CACHE_SIZE 128
+#define PARSE_CACHE_BUCKETS 256
+#define PARSE_CACHE_BLOCK 512
+#define MAX_PARALLEL_JOBS 1024
 
 // Prompt config
 #define PROMPT_STR "<:"
+#define PROMPT_VAR_NAME "PROMPT"
+#define DEFAULT_PROMPT "\\u@<\\w> " PROMPT_STR
 
 // other strings and values
 #define PATH_VAR_NAME "PATH"
 #define CD "cd"
+#define HASH "hash"
+#define TIME_KEYWORD "time"
+#define TIMING_ENV_VAR "CSCSHELL_TIMING"
 #define VARIABLE_PARSE_MARKER '$'
 #define PARSING_START_MARKER '<'
 #define PARSING_END_MARKER '>'
@@ -48,8 +83,8 @@
 
 // Error Strings
 #define ERR_ARGS_MISSING "Missing init file path after argument: '-i'\n"
-#define ERR_PATH_INIT "PATH not defined in init file %s, or not at the head \
-of the variable list."
+#define ERR_ARGS_MISSING_J "Missing number of jobs after argument: '-j'\n"
+#define ERR_PATH_INIT "PATH not defined in init file %s.\n"
 #define ERR_PARSING_LINE "Could not parse line into commands.\n"
 #define ERR_EXECUTE_LINE "Could not execute line.\n"
 #define ERR_INIT_SCRIPT "Failed to run init script: %s\n"
@@ -61,6 +96,17 @@ of the variable list."
 #define ERR_NO_EXECU "Could not resolve executable [%s]\n"
 #define ERR_VAR_USAGE "Variable could not be parsed from %s\n"
 #define ERR_VAR_NOT_FOUND "Could not find variable: <%s>\n"
+#define ERR_UNTERMINATED "Unterminated quote: missing closing %c\n"
+#define ERR_SYNTAX "Syntax error near unexpected token '%s'\n"
+#define ERR_HASH_USAGE "usage: hash [-r]\n"
+#define ERR_PIPE_SIZE "Invalid pipe size: %s\n"
+#define ERR_JOBS "Invalid number of jobs: %s\n"
+#define ERR_PAR_USAGE "usage: par [-j N] CMD [ARG]... [::: ITEM...]\n"
+#define ERR_LAUNCH_MODE "Unknown launch mode: %s (expected fork, spawn or zygote)\n"
+#define ERR_ARGS_MISSING_C "Missing command after argument: '-c'\n"
+#define ERR_SOCKET_PATH "Socket path too long: %s\n"
+#define ERR_NOT_SOCKET "Not a socket, will not replace it: %s\n"
+#define ERR_C_WITHOUT_CLIENT "-c needs --client=SOCKET\n"
 
 #define ERR_PRINT(...) fprintf(stderr, "ERROR: ");\
     fprintf(stderr, __VA_ARGS__);
@@ -68,10 +114,8 @@ of the variable list."
 /*
 ** Two structures for maintaining a singly-linked list of:
 **
-** 1. Shell Variables; including PATH, which is the
-**    first item of main variable list. Consider using
-**    this list structure for replacing variables used
-**    in a shell command as well.
+** 1. Shell Variables; chained in the order they were first
+**    assigned and indexed by a VarTable (see vars.c).
 ** 2. Commands to execute; A single line may have only a
 **    single command, or may consist of multiple commands
 **    connected by pipes.
@@ -82,6 +126,166 @@ typedef struct Variable{
     struct Variable *next;
 } Variable;
 
+/*
+** The shell's variables: an open-addressing hash index over the
+** Variable list, so assignment and lookup are O(1) and each name
+** appears once. PATH, if set, is always reachable through path.
+** A zeroed VarTable is an empty store.
+*/
+typedef struct VarTable {
+    Variable **slots;
+    size_t cap;
+    size_t count;
+    Variable *head;
+    Variable *tail;
+    Variable *path;
+} VarTable;
+
+/*
+** How run_command starts a child: a plain fork() + execve(),
+** posix_spawn(), or through the zygote (see zygote.c). The default can
+** be picked at build time with -DDEFAULT_LAUNCH=LAUNCH_FORK and at
+** runtime with --launch=.
+*/
+typedef enum LaunchMode {
+    LAUNCH_FORK,
+    LAUNCH_SPAWN,
+    LAUNCH_ZYGOTE
+} LaunchMode;
+
+#ifndef DEFAULT_LAUNCH
+#define DEFAULT_LAUNCH LAUNCH_SPAWN
+#endif
+
+/*
+** A per-line bump allocator (see arena.c). Everything parse_line builds
+** for a line lives in the arena passed to it and is released all at
+** once by arena_reset. A zeroed Arena is ready to use; block_size may
+** be set first for arenas that only ever hold a little.
+*/
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *first;
+    ArenaBlock *current;
+    size_t block_size;
+    #ifdef DEBUG
+    size_t num_allocs;
+    size_t num_bytes;
+    #endif
+} Arena;
+
+/*
+** How far a search for the end of a line has got (see reader.c): the
+** quote it is in, whether the last character was an unquoted (1) or
+** double quoted (2) backslash, and whether it is in a comment or at the
+** start of a word.
+*/
+typedef struct LineScan {
+    char quote;
+    uint8_t escaped;
+    uint8_t comment;
+    uint8_t word_start;
+} LineScan;
+
+/*
+** A script being read (see reader.c). Regular files are mapped
+** read-only and each line is copied out of map into buf; anything else
+** is streamed through buf, of which [pos, len) has not been handed out
+** yet and [pos, scan) has been searched, leaving scan_state.
+*/
+typedef struct ScriptReader {
+    int fd;
+    uint8_t owns_fd;
+    uint8_t eof;
+    struct stat st;
+    char *map;
+    char *buf;
+    size_t cap;
+    size_t len;
+    size_t pos;
+    size_t scan;
+    LineScan scan_state;
+} ScriptReader;
+
+/*
+** The lexer's view of a line (see lex.c): spans into the line, not
+** copies. TOK_WORD spans still contain any quotes and escapes; quoted
+** is set if dequote has anything to remove. end is where lexing
+** stopped, i.e. the end of the line or the start of a comment.
+*/
+typedef enum TokenKind {
+    TOK_WORD,
+    TOK_PIPE,
+    TOK_REDIR_IN,
+    TOK_REDIR_OUT,
+    TOK_REDIR_APPEND,
+    TOK_BACKGROUND
+} TokenKind;
+
+typedef struct Token {
+    uint32_t offset;
+    uint32_t length;
+    TokenKind kind;
+    uint8_t quoted;
+} Token;
+
+typedef struct TokenList {
+    Token *tokens;
+    size_t count;
+    size_t cap;
+    size_t end;
+} TokenList;
+
+/*
+** A compiled line, independent of variable values (see parse.c).
+**
+** Each word is a list of parts: literal text with quotes and escapes
+** already resolved, a variable to look up when the line runs, or the
+** text of a $(...) command whose output replaces it, with line holding
+** that command compiled. quoted is set for variables and commands
+** inside double quotes, whose values are never split into several
+** arguments.
+**
+** A LineTemplate is either an assignment (assign_name set) or a
+** pipeline of num_stages stages; an empty or comment line has none.
+*/
+typedef enum WordPartKind {
+    PART_LITERAL,
+    PART_VARIABLE,
+    PART_COMMAND
+} WordPartKind;
+
+typedef struct WordPart {
+    WordPartKind kind;
+    uint8_t quoted;
+    const char *text;
+    size_t len;
+    struct LineTemplate *line;
+} WordPart;
+
+typedef struct Word {
+    WordPart *parts;
+    size_t num_parts;
+} Word;
+
+typedef struct StageTemplate {
+    Word *words;
+    size_t num_words;
+    Word *redir_in;
+    Word *redir_out;
+    uint8_t redir_append;
+} StageTemplate;
+
+typedef struct LineTemplate {
+    char *assign_name;
+    Word assign_value;
+    StageTemplate *stages;
+    size_t num_stages;
+    uint8_t background;
+    uint8_t timed;
+} LineTemplate;
+
 typedef struct Command {
     char *exec_path;
     char **args;
@@ -91,6 +295,8 @@ typedef struct Command {
     char *redir_in_path;
     char *redir_out_path;
     uint8_t redir_append;
+    uint8_t background;
+    uint8_t timed;
 } Command;
 
 
@@ -104,6 +310,8 @@ typedef struct Command {
 /*
 ** Parses a single line of text and returns a linked list of commands.
 ** The last command in the list has a next pointer that points to NULL.
+** The commands and all their strings are allocated from arena and stay
+** valid until it is next reset.
 **
 ** Return possibilities:
 ** 1. The first in a list of commands that should execute roughly
@@ -120,19 +328,88 @@ typedef struct Command {
 **
 ** 3. If there is an error, returns -1 cast as a (Command *)
 */
-Command *parse_line(char *line, Variable **variables);
+Command *parse_line(char *line, VarTable *variables, Arena *arena);
+
+/*
+** Compiles line into a LineTemplate allocated from arena. No variables
+** are looked at; see instantiate_line.
+**
+** Returns the template, or (LineTemplate *) -1 after printing an error
+** if the line is malformed.
+*/
+LineTemplate *compile_line(const char *line, Arena *arena);
+
+/*
+** Fills the current variable values into tmpl. Assignments are applied
+** and give NULL; pipelines give a list of Commands allocated from arena
+** (NULL if the line expands to nothing). Returns (Command *) -1 on
+** error, like parse_line.
+*/
+Command *instantiate_line(LineTemplate *tmpl, VarTable *variables, Arena *arena);
+
+/*
+** A list of words outside of a line (the words of a for loop).
+** compile_words compiles the words of text, which may not contain
+** operators; returns 0, or -1 (after printing an error) on error.
+** instantiate_words fills them in like the arguments of a command and
+** returns a NULL terminated array allocated from arena.
+*/
+int compile_words(const char *text, Word **words, size_t *num_words, Arena *arena);
+char **instantiate_words(Word *words, size_t num_words, VarTable *variables,
+                         Arena *arena);
+
+/*
+** Command substitution, see subst.c. Runs the compiled line and returns
+** what it wrote to its output as a heap string, without trailing
+** newlines, and sets $? to its status. Returns NULL if the line could
+** not run.
+*/
+char *capture_command(LineTemplate *line, VarTable *variables);
+
+/*
+** The parse cache (see parsecache.c). parse_cache_get returns the
+** template for line, compiling it on a miss; it stays valid until
+** PARSE_CACHE_SIZE other lines have been looked up since it was last
+** used, or parse_cache_clear. Returns (LineTemplate *) -1 on error.
+*/
+LineTemplate *parse_cache_get(const char *line);
+void parse_cache_clear();
+
+/*
+** Splits line into tokens in a single pass, with the token array
+** allocated from arena.
+**
+** Returns 0 on success, -1 (after printing an error) if a quote is
+** left unterminated.
+*/
+int lex_line(const char *line, TokenList *list, Arena *arena);
+
+/*
+** Given the '(' of a $(...) command substitution, returns its matching
+** ')', skipping quoted text and nested parentheses, or NULL if the
+** string ends first.
+*/
+const char *substitution_end(const char *open);
+
+/*
+** Copies the len bytes of a word at src to dst with quotes removed and
+** escapes applied. dst may be src. Returns the number of bytes written;
+** no NUL terminator is added.
+*/
+size_t dequote(char *dst, const char *src, size_t len);
 
 /*
 ** WARNING: this is a challenging string parsing task.
 **
 ** Creates a new line on the heap with all named variable *usages*
-** replaced with their associated values.
+** replaced with their associated values. $(...) is not run here; only
+** compiled lines substitute commands (see capture_command).
 **
 ** Returns NULL if replacement parsing had an error, or (char *) -1 if
 ** system calls fail and the shell needs to exit.
 */
 char *replace_variables_mk_line(const char *line,
-                                Variable *variables);
+                                VarTable *variables);
 
 /*
 ** This function is provided for you and should not be modified.
@@ -160,13 +437,143 @@ int cd_cscshell(const char *target_dir);
 */
 char *resolve_executable(const char *command_name, Variable *path);
 
+/*
+** Variable store operations (see vars.c).
+**
+** vars_get/vars_getn return the variable called name (the first len
+** bytes of name for vars_getn), or NULL if it is not set.
+**
+** vars_set adds or updates a variable, copying name and value.
+** Returns 0 on success, -1 if memory ran out.
+**
+** vars_unset removes the variable called name, returning 1 if it was
+** set and 0 if it was not.
+*/
+Variable *vars_get(VarTable *vars, const char *name);
+Variable *vars_getn(VarTable *vars, const char *name, size_t len);
+int vars_set(VarTable *vars, const char *name, const char *value);
+int vars_unset(VarTable *vars, const char *name);
+void vars_free(VarTable *vars);
+
+/*
+** Returns 1 if name can be used as a variable name, 0 otherwise.
+*/
+int is_valid_variable_name(const char *name);
+
+/*
+** FNV-1a over len bytes, shared by the shell's hash tables.
+*/
+size_t hash_bytes(const char *bytes, size_t len);
+
+/*
+** Same contract as resolve_executable, but remembers where each command
+** was found (see hash.c). Cached entries are dropped when the PATH value
+** changes, or when the mtime of any PATH directory that could shadow
+** them changes.
+*/
+char *hash_resolve(const char *command_name, Variable *path);
+
+/*
+** The `hash` builtin: with no arguments lists the cached commands and
+** their hit counts on out_fd, `hash -r` forgets them all.
+**
+** Returns the exit status of the builtin.
+*/
+int hash_builtin(char **args, int in_fd, int out_fd);
+
+/*
+** Frees everything held by the command hash table.
+*/
+void hash_free();
+
+/*
+** Copies the names in the hash table into buf, each NUL terminated, as
+** many as fit in cap bytes. Returns the bytes used.
+*/
+size_t hash_names(char *buf, size_t cap);
+
+/*
+** The persistent PATH index, see pathidx.c.
+**
+** pathidx_open remembers the index file and maps it if it exists;
+** returns 0 on success, -1 on error.
+**
+** pathidx_sync checks the mapped index against the given PATH
+** directories and rebuilds it on disk if any of them changed;
+** returns 0 if the index can be used for lookups, -1 otherwise.
+**
+** pathidx_lookup returns the position in the synced directory list of
+** the first directory containing command_name, -1 if there is none, or
+** -2 if the index is not usable.
+*/
+int pathidx_open(const char *file);
+int pathidx_enabled();
+int pathidx_sync(char **dirs, size_t num_dirs);
+ssize_t pathidx_lookup(const char *command_name);
+void pathidx_close();
+
+/*
+** Script reading, see reader.c. reader_open opens path ("-" for stdin)
+** and returns 0, or -1 if it cannot be opened.
+**
+** reader_next returns the next logical line with its newline removed
+** and any backslash-newline continuations joined. The line may be
+** modified, and stays valid until the next call. Returns NULL at the
+** end of the script, or (char *) -1 if reading failed. reader_source
+** is reader_next for run_block, which takes any source of lines.
+*/
+int reader_open(ScriptReader *reader, const char *path);
+char *reader_next(ScriptReader *reader);
+char *reader_source(void *reader);
+void reader_close(ScriptReader *reader);
+
+/*
+** Writes len bytes of buf to file through a temporary file that is
+** renamed into place, creating missing parent directories.
+** Returns 0 on success, -1 on failure.
+*/
+int write_file_atomic(const char *file, const void *buf, size_t len);
+
+/*
+** Precompiled scripts, see scriptcache.c. script_cache_open turns the
+** cache on, keeping compiled scripts in dir.
+**
+** run_script_cached behaves like run_script but runs the script from
+** its compiled form, compiling and saving it first if there is no
+** up to date one. Returns -2 without reading any lines if the cache is
+** off or the script is not a mapped file (run_script reads it normally).
+*/
+int script_cache_open(const char *dir);
+int script_cache_enabled();
+int run_script_cached(ScriptReader *reader, VarTable *root);
+void script_cache_close();
+
+/*
+** Init file snapshots, see snapshot.c. init_snapshot_open turns them
+** on, keeping snapshots in dir.
+**
+** run_init_file runs the init file like run_script, but an init file
+** of only assignments is run once and its variables are then loaded
+** from a snapshot for as long as the file does not change.
+*/
+int init_snapshot_open(const char *dir);
+int run_init_file(char *init_file, VarTable *root);
+void init_snapshot_close();
+
 /*
 ** Executes a single "line" of commands (through pipes)
-** If a command fails, the rest of the line should not be executed.
+** Every stage is started before any of them is waited on, so the
+** stages of a pipeline run concurrently. If a command fails to start,
+** the rest of the line is not started.
 **
-** The error code from the last command is returned through a pointer
-** to a heap integer on success. If the line is a `cd` command, the
-** return value of `cd_cscshell` is stored by the heap int.
+** The exit code of the last command is returned through a pointer
+** to a heap integer on success (128 + signal number if it was killed).
+** If the line is a `cd` command, the return value of `cd_cscshell`
+** is stored by the heap int. A line marked background is not waited
+** for: it becomes a job (see jobs.c) and its status is 0. A line
+** marked timed (time in front of it), or every line once
+** set_line_timing is on, reports the wall and CPU time, max RSS and
+** context switches of each stage and of the whole line on stderr.
 ** -- If there are no commands to execute, returns NULL
 ** -- If there were any errors starting any commands,
 **    returns (pointer value) -1
@@ -174,27 +581,208 @@ char *resolve_executable(const char *command_name, Variable *path);
 int *execute_line(Command *head);
 
 /*
-** Forks a new process and execs the command
-** making sure all file descriptors are set up correctly.
+** The first half of execute_line: starts every stage of head and runs
+** its builtins, but waits for nothing. Returns a heap array with the
+** pid of each of the *num_stages stages (0 where nothing is left to
+** wait for), or NULL if the line could not be started. *status is the
+** line's status if it is already known (the last stage was a builtin
+** or could not start), -1 otherwise.
+*/
+pid_t *start_line(Command *head, size_t *num_stages, int *status);
+
+/*
+** Makes execute_line time every line it waits for, as if each started
+** with time (cscshell sets it when CSCSHELL_TIMING=1).
+*/
+void set_line_timing(int on);
+
+/*
+** Builtins (see run.c) run in the shell process. is_builtin tells
+** whether name is one, and builtin_changes_shell whether it is one
+** that changes the shell's state (cd, exit, ...). set_builtin_variables
+** gives export, unset, type and par the shell's variables, and
+** builtin_variables returns them. set_status_variable sets $? or $!
+** in them to value.
+**
+** exit_requested returns non-zero once the exit builtin has run, and
+** stores the status it was given through status (if not NULL). Script
+** and prompt loops stop after the line that ran it.
+*/
+int is_builtin(const char *name);
+int builtin_changes_shell(const char *name);
+void set_builtin_variables(VarTable *variables);
+VarTable *builtin_variables();
+void set_status_variable(const char *name, long value);
+int exit_requested(int *status);
+
+/*
+** Background jobs, see jobs.c. jobs_init installs the SIGCHLD handler.
+** jobs_add records a started background line (head is only used for
+** the text jobs prints) and returns its job id, or -1 on error. Every
+** stage of a background line is a child, builtins too, so every one
+** that started has a pid. status is the job's exit status if it is
+** already known (the last stage could not be started), or -1 to take
+** it from the last of pids.
+** jobs_reap books the stages the SIGCHLD handler has reaped since, and
+** forgets the oldest finished jobs past JOBS_MAX_FINISHED.
+** jobs_child_exited hands over a pid reaped by someone else (with
+** waitpid(-1)), returning 1 if it belonged to a job.
+** jobs_builtin and wait_builtin are the jobs and wait builtins.
+*/
+void jobs_init();
+int jobs_add(Command *head, pid_t *pids, size_t num_pids, int status);
+void jobs_reap();
+int jobs_child_exited(pid_t pid, int status);
+int jobs_builtin(char **args, int in_fd, int out_fd);
+int wait_builtin(char **args, int in_fd, int out_fd);
+void jobs_free();
+
+/*
+** The par builtin, see par.c: runs a command once per item on a bounded
+** number of children, buffering each child's output.
+*/
+int par_builtin(char **args, int in_fd, int out_fd);
+
+/*
+** The cat and tee builtins (see copy.c), and the copy they are built
+** on: copy_fd moves everything from in_fd to out_fd with splice,
+** sendfile or copy_file_range where the fds allow it, read/write
+** otherwise. Returns 0 at the end of input, -1 on error (with errno).
+*/
+int copy_fd(int in_fd, int out_fd);
+int cat_builtin(char **args, int in_fd, int out_fd);
+int tee_builtin(char **args, int in_fd, int out_fd);
+
+/*
+** Control flow, see flow.c. is_block_line tells whether line starts
+** with a keyword of an if, while or for block. run_block runs the block
+** line starts, reading the rest of it with next_line(source) (which
+** returns lines like reader_next). Returns 1 when the block is done, 0
+** if it ran exit, or -1 on error (a syntax error included).
 **
-** Parent process returns -1 on error.
+** test_builtin is the test and [ builtin the conditions use.
+*/
+int is_block_line(const char *line);
+int run_block(const char *line, char *(*next_line)(void *source), void *source,
+              VarTable *root);
+int test_builtin(char **args, int in_fd, int out_fd);
+
+/*
+** Sets the size requested with F_SETPIPE_SZ for every pipe created by
+** execute_line. 0 (the default) leaves the kernel's default size.
+*/
+void set_pipe_size(int bytes);
+
+/*
+** Converts a status from waitpid into a shell exit code.
+*/
+int status_to_exit_code(int status);
+
+/*
+** Selects how run_command starts children from now on.
+*/
+void set_launch_mode(LaunchMode mode);
+
+/*
+** The zygote launch helper, see zygote.c. zygote_start forks it (0 on
+** success, -1 on error) and zygote_stop ends it. zygote_launch starts
+** command through it like run_command would and returns the child's
+** pid (a child of the shell), -1 if the child could not be started, or
+** -2 if there is no zygote (any more). zygote_cwd_changed is called
+** after every successful cd, and zygote_forked in a forked copy of the
+** shell, which must not use the parent's zygote.
+*/
+int zygote_start();
+pid_t zygote_launch(Command *command);
+void zygote_cwd_changed();
+void zygote_forked();
+void zygote_stop();
+
+/*
+** Daemon mode, see serve.c. serve runs scripts for clients connecting
+** to socket_path, each in a worker forked from the shell as it is once
+** the init file has run; it only returns (-1) on error. serve_client
+** has the server at socket_path run script (or command, or stdin if
+** both are NULL) with this process's stdio, working directory and
+** environment, and returns the status the shell would have, or -1 if
+** it got none.
+*/
+int serve(const char *socket_path, VarTable *root);
+int serve_client(const char *socket_path, const char *script, const char *command);
+
+/*
+** Forks (or posix_spawns, see LaunchMode) a new process and execs the
+** command making sure all file descriptors are set up correctly.
+** command->exec_path must already be resolved (see hash_resolve);
+** it is exec'd directly without searching PATH again. stdin_fd and
+** stdout_fd are dup'd onto the child's stdin/stdout when they differ
+** from STDIN_FILENO/STDOUT_FILENO.
+**
+** Parent process returns the child's pid, -1 on error, or 0 when
+** spawning reported that the command itself could not be started
+** (bad redirection or exec failure; treated as exit status 1).
 ** Any child processes should not return.
 */
 int run_command(Command *command);
 
 /*
-** Executes an entire script line-by-line.
-** Stops and indicates an error as soon as any line fails.
+** Executes an entire script line-by-line; file_path "-" reads the
+** script from stdin. Stops and indicates an error as soon as any line
+** fails.
 **
 ** Returns 0 on success, -1 on error
 */
-int run_script(char *file_path, Variable **root);
+int run_script(char *file_path, VarTable *root);
 
 /*
-** Implement the following function that frees all the
-** heap memory associated with a particular command.
- */
-void free_command(Command *command);
+** Parallel scripts, see parallel.c. set_parallel_jobs sets how many
+** lines may run at once (cscshell -j N); with more than one,
+** run_script goes through run_script_parallel.
+*/
+void set_parallel_jobs(int jobs);
+int parallel_jobs();
+int run_script_parallel(ScriptReader *reader, VarTable *root);
+
+/*
+** The interactive prompt, see prompt.c. prompt_write renders $PROMPT (or
+** DEFAULT_PROMPT) with one write to stdout and returns 0, or -1 if the
+** write failed. prompt_cwd_changed is called after every successful cd,
+** prompt_line_done after every interactive line with its status and
+** how long it took.
+*/
+int prompt_write(VarTable *variables);
+void prompt_cwd_changed();
+void prompt_line_done(int status, long elapsed_us);
+void prompt_free();
+
+/*
+** Chrome trace output, see trace.c. trace_open starts writing events to
+** file (0 on success, -1 on error); until then, and after trace_close,
+** every other call does nothing. trace_begin and trace_end bracket work
+** the shell does itself. trace_child_started and trace_child_exited
+** bracket a child's lifetime, and trace_forked stops a forked copy of
+** the shell from writing events of its own.
+*/
+int trace_open(const char *file);
+int trace_enabled();
+void trace_begin(const char *name);
+void trace_end(const char *name);
+void trace_child_started(pid_t pid, const char *name);
+void trace_child_exited(pid_t pid, int status);
+void trace_forked();
+void trace_close();
+
+/*
+** Arena operations (see arena.c). arena_alloc never returns NULL; the
+** shell exits if memory runs out. arena_reset releases everything
+** allocated so far in O(1) and, in DEBUG builds, reports how many
+** allocations the line made. arena_free gives the blocks back.
+*/
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strdup(Arena *arena, const char *str);
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
 
 /*
 ** Implement the following function that frees variable(s).
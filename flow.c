@@ -0,0 +1,591 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+/*
+** Control flow: if/elif/else/fi, while/do/done and for/in/do/done
+** blocks, and the test and [ builtins their conditions use.
+**
+**     if COND; then              while COND; do        for NAME in WORD...; do
+**         ...                        ...                   ...
+**     elif COND; then            done                  done
+**         ...
+**     else
+**         ...
+**     fi
+**
+** then and do may also be on a line of their own. The keywords are only
+** recognised at the start of a line (the shell has no ; between
+** commands otherwise).
+**
+** A block is read in full before any of it runs, and every line in it
+** is compiled into a LineTemplate then, once, along with the line of
+** any $(...) in it; each iteration only fills the templates in with
+** instantiate_line, and lexes nothing. A condition is a line like
+** any other, true if its status is 0. The words after in are filled in
+** once, when the loop starts.
+*/
+
+#define KEYWORD_IF "if"
+#define KEYWORD_ELIF "elif"
+#define KEYWORD_THEN "then"
+#define KEYWORD_ELSE "else"
+#define KEYWORD_FI "fi"
+#define KEYWORD_WHILE "while"
+#define KEYWORD_FOR "for"
+#define KEYWORD_IN "in"
+#define KEYWORD_DO "do"
+#define KEYWORD_DONE "done"
+
+typedef enum NodeKind {
+    NODE_LINE,
+    NODE_IF,
+    NODE_WHILE,
+    NODE_FOR
+} NodeKind;
+
+/*
+** One line or block of a block's body. line is the line to run for
+** NODE_LINE and the condition for NODE_IF and NODE_WHILE. orelse is
+** what an if runs when its condition fails: a single NODE_IF for elif,
+** or the else body.
+*/
+typedef struct Node {
+    NodeKind kind;
+    LineTemplate *line;
+    struct Node *body;
+    struct Node *orelse;
+    char *var;
+    Word *words;
+    size_t num_words;
+    struct Node *next;
+} Node;
+
+typedef struct BlockParser {
+    char *(*next_line)(void *source);
+    void *source;
+    Arena *arena;
+} BlockParser;
+
+static const char *openers[] = {KEYWORD_IF, KEYWORD_WHILE, KEYWORD_FOR, NULL};
+static const char *closers[] = {KEYWORD_THEN, KEYWORD_ELIF, KEYWORD_ELSE,
+                                KEYWORD_FI, KEYWORD_DO, KEYWORD_DONE, NULL};
+
+/*
+** If line starts with keyword as a word of its own, returns what
+** follows it with leading whitespace skipped, otherwise NULL.
+*/
+static char *after_keyword(const char *line, const char *keyword){
+    while (isspace((unsigned char) *line)) {line++;}
+    size_t len = strlen(keyword);
+    if (strncmp(line, keyword, len) != 0 ||
+        (line[len] != '\0' && line[len] != ';' && !isspace((unsigned char) line[len]))){
+        return NULL;
+    }
+    line += len;
+    while (isspace((unsigned char) *line)) {line++;}
+    return (char *) line;
+}
+
+// the keyword line starts with, out of keywords
+static const char *starting_keyword(const char *line, const char **keywords){
+    for (size_t i = 0; keywords[i] != NULL; i++){
+        if (after_keyword(line, keywords[i]) != NULL){
+            return keywords[i];
+        }
+    }
+    return NULL;
+}
+
+// is line keyword alone, or followed by a comment
+static int is_keyword_line(const char *line, const char *keyword){
+    const char *rest = after_keyword(line, keyword);
+    return rest != NULL && (*rest == '\0' || *rest == '#');
+}
+
+static int is_blank(const char *line){
+    while (isspace((unsigned char) *line)) {line++;}
+    return *line == '\0' || *line == '#';
+}
+
+/*
+** Splits "HEADER; keyword" at the ;, leaving HEADER in text, and
+** returns 1. Returns 0 if text does not end that way (a trailing ; is
+** still dropped).
+*/
+static int split_keyword(char *text, const char *keyword){
+    size_t len = strlen(text);
+    while (len > 0 && isspace((unsigned char) text[len - 1])) {len--;}
+    text[len] = '\0';
+    size_t keyword_len = strlen(keyword);
+    int found = 0;
+    if (len > keyword_len && strcmp(text + len - keyword_len, keyword) == 0){
+        size_t i = len - keyword_len;
+        while (i > 0 && isspace((unsigned char) text[i - 1])) {i--;}
+        if (i > 0 && text[i - 1] == ';'){
+            len = i;
+            found = 1;
+        }
+    }
+    if (len > 0 && text[len - 1] == ';'){
+        text[--len] = '\0';
+    }
+    return found;
+}
+
+static void syntax_error(const char *line){
+    char token[32];
+    while (isspace((unsigned char) *line)) {line++;}
+    size_t len = strcspn(line, " \t\r\n;");
+    snprintf(token, sizeof(token), "%.*s", (int) len, line);
+    ERR_PRINT(ERR_SYNTAX, token);
+}
+
+// the next line of the block, NULL (after reporting it) at the end
+static char *block_line(BlockParser *parser){
+    char *line = parser->next_line(parser->source);
+    if (line == NULL){
+        ERR_PRINT(ERR_SYNTAX, "end of file");
+    }
+    return line == (char *) -1 ? NULL : line;
+}
+
+// reads up to the keyword that must come next (then, do)
+static int expect_keyword(BlockParser *parser, const char *keyword){
+    char *line;
+    while ((line = block_line(parser)) != NULL && is_blank(line)){}
+    if (line == NULL){
+        return -1;
+    }
+    if (!is_keyword_line(line, keyword)){
+        syntax_error(line);
+        return -1;
+    }
+    return 0;
+}
+
+static LineTemplate *compile_condition(const char *text, Arena *arena){
+    LineTemplate *tmpl = compile_line(text, arena);
+    if (tmpl != (LineTemplate *) -1 && tmpl->num_stages == 0 &&
+        tmpl->assign_name == NULL){
+        ERR_PRINT(ERR_SYNTAX, "newline");
+        return (LineTemplate *) -1;
+    }
+    return tmpl;
+}
+
+static Node *parse_block(BlockParser *parser, const char *line);
+
+/*
+** Parses lines into a list of nodes up to one that starts with one of
+** the keywords in ends, which is copied into the arena and returned
+** through end_line. Returns (Node *) -1 on error.
+*/
+static Node *parse_list(BlockParser *parser, const char **ends, char **end_line){
+    Node *head = NULL;
+    Node **tail = &head;
+    char *line;
+    while ((line = block_line(parser)) != NULL){
+        if (is_blank(line)){
+            continue;
+        }
+        if (starting_keyword(line, ends) != NULL){
+            *end_line = arena_strndup(parser->arena, line, strlen(line));
+            return head;
+        }
+        if (starting_keyword(line, closers) != NULL){
+            syntax_error(line);
+            return (Node *) -1;
+        }
+
+        Node *node;
+        if (starting_keyword(line, openers) != NULL){
+            node = parse_block(parser, line);
+            if (node == (Node *) -1){
+                return node;
+            }
+        }
+        else {
+            node = arena_alloc(parser->arena, sizeof(Node));
+            memset(node, 0, sizeof(Node));
+            node->kind = NODE_LINE;
+            node->line = compile_line(line, parser->arena);
+            if (node->line == (LineTemplate *) -1){
+                return (Node *) -1;
+            }
+        }
+        *tail = node;
+        tail = &node->next;
+    }
+    return (Node *) -1;
+}
+
+// if COND (or elif COND) and everything up to its fi
+static Node *parse_if(BlockParser *parser, char *cond){
+    static const char *ends[] = {KEYWORD_ELIF, KEYWORD_ELSE, KEYWORD_FI, NULL};
+    static const char *else_ends[] = {KEYWORD_FI, NULL};
+
+    Node *node = arena_alloc(parser->arena, sizeof(Node));
+    memset(node, 0, sizeof(Node));
+    node->kind = NODE_IF;
+    if (!split_keyword(cond, KEYWORD_THEN) && expect_keyword(parser, KEYWORD_THEN) < 0){
+        return (Node *) -1;
+    }
+    if ((node->line = compile_condition(cond, parser->arena)) == (LineTemplate *) -1){
+        return (Node *) -1;
+    }
+
+    char *end_line;
+    if ((node->body = parse_list(parser, ends, &end_line)) == (Node *) -1){
+        return (Node *) -1;
+    }
+    // an elif goes on to the fi of the whole if
+    char *rest;
+    if ((rest = after_keyword(end_line, KEYWORD_ELIF)) != NULL){
+        node->orelse = parse_if(parser, rest);
+        return node->orelse == (Node *) -1 ? node->orelse : node;
+    }
+    if (after_keyword(end_line, KEYWORD_ELSE) != NULL){
+        if (!is_keyword_line(end_line, KEYWORD_ELSE)){
+            syntax_error(after_keyword(end_line, KEYWORD_ELSE));
+            return (Node *) -1;
+        }
+        node->orelse = parse_list(parser, else_ends, &end_line);
+    }
+    if (node->orelse == (Node *) -1){
+        return (Node *) -1;
+    }
+    if (!is_keyword_line(end_line, KEYWORD_FI)){
+        syntax_error(after_keyword(end_line, KEYWORD_FI));
+        return (Node *) -1;
+    }
+    return node;
+}
+
+// NAME in WORD... of a for line
+static int parse_for_header(BlockParser *parser, char *header, Node *node){
+    size_t name_len = strcspn(header, " \t\r\n");
+    node->var = arena_strndup(parser->arena, header, name_len);
+    if (!is_valid_variable_name(node->var)){
+        ERR_PRINT(ERR_VAR_NAME, node->var);
+        return -1;
+    }
+    char *words = after_keyword(header + name_len, KEYWORD_IN);
+    if (words == NULL){
+        syntax_error(header + name_len);
+        return -1;
+    }
+    return compile_words(words, &node->words, &node->num_words, parser->arena);
+}
+
+/*
+** Parses the block line starts (if, while or for) up to its fi or
+** done, reading the rest of it from the parser's source.
+*/
+static Node *parse_block(BlockParser *parser, const char *line){
+    static const char *loop_ends[] = {KEYWORD_DONE, NULL};
+
+    // the source may reuse line
+    char *header = arena_strndup(parser->arena, line, strlen(line));
+    char *rest;
+    if ((rest = after_keyword(header, KEYWORD_IF)) != NULL){
+        return parse_if(parser, rest);
+    }
+
+    Node *node = arena_alloc(parser->arena, sizeof(Node));
+    memset(node, 0, sizeof(Node));
+    int has_do;
+    if ((rest = after_keyword(header, KEYWORD_WHILE)) != NULL){
+        node->kind = NODE_WHILE;
+        has_do = split_keyword(rest, KEYWORD_DO);
+        node->line = compile_condition(rest, parser->arena);
+        if (node->line == (LineTemplate *) -1){
+            return (Node *) -1;
+        }
+    }
+    else {
+        node->kind = NODE_FOR;
+        rest = after_keyword(header, KEYWORD_FOR);
+        has_do = split_keyword(rest, KEYWORD_DO);
+        if (parse_for_header(parser, rest, node) < 0){
+            return (Node *) -1;
+        }
+    }
+    if (!has_do && expect_keyword(parser, KEYWORD_DO) < 0){
+        return (Node *) -1;
+    }
+
+    char *end_line;
+    if ((node->body = parse_list(parser, loop_ends, &end_line)) == (Node *) -1){
+        return (Node *) -1;
+    }
+    if (!is_keyword_line(end_line, KEYWORD_DONE)){
+        syntax_error(after_keyword(end_line, KEYWORD_DONE));
+        return (Node *) -1;
+    }
+    return node;
+}
+
+
+/*
+** Runs one line of a block, storing its status through status if it is
+** not NULL. Returns 1 to go on, 0 if the line ran exit, -1 on error.
+*/
+static int run_line(LineTemplate *tmpl, VarTable *root, Arena *arena, int *status){
+    Command *cmd = instantiate_line(tmpl, root, arena);
+    if (cmd == (Command *) -1){
+        arena_reset(arena);
+        return -1;
+    }
+    int line_status = 0;
+    if (cmd){
+        int *result = execute_line(cmd);
+        if (result == (int *) -1){
+            arena_reset(arena);
+            return -1;
+        }
+        line_status = *result;
+        free(result);
+    }
+    arena_reset(arena);
+    if (status != NULL){
+        *status = line_status;
+    }
+    return exit_requested(NULL) ? 0 : 1;
+}
+
+static int run_nodes(Node *node, VarTable *root, Arena *arena){
+    int ret = 1;
+    int status;
+    for (; node != NULL && ret > 0; node = node->next){
+        switch (node->kind){
+        case NODE_LINE:
+            ret = run_line(node->line, root, arena, NULL);
+            break;
+
+        case NODE_IF:
+            ret = run_line(node->line, root, arena, &status);
+            if (ret > 0){
+                ret = run_nodes(status == 0 ? node->body : node->orelse, root, arena);
+            }
+            break;
+
+        case NODE_WHILE:
+            while ((ret = run_line(node->line, root, arena, &status)) > 0 &&
+                   status == 0 && (ret = run_nodes(node->body, root, arena)) > 0){}
+            break;
+
+        case NODE_FOR: {
+            // the body resets arena after every line
+            Arena words_arena = {0};
+            char **values = instantiate_words(node->words, node->num_words,
+                                              root, &words_arena);
+            for (size_t i = 0; values[i] != NULL && ret > 0; i++){
+                if (vars_set(root, node->var, values[i]) < 0){
+                    ret = -1;
+                    break;
+                }
+                ret = run_nodes(node->body, root, arena);
+            }
+            arena_free(&words_arena);
+            break;
+        }
+        }
+    }
+    return ret;
+}
+
+
+int is_block_line(const char *line){
+    return starting_keyword(line, openers) != NULL ||
+        starting_keyword(line, closers) != NULL;
+}
+
+int run_block(const char *line, char *(*next_line)(void *source), void *source,
+              VarTable *root){
+    if (starting_keyword(line, openers) == NULL){
+        syntax_error(line);
+        return -1;
+    }
+
+    Arena block_arena = {0};
+    Arena arena = {0};
+    BlockParser parser = {next_line, source, &block_arena};
+    trace_begin("parse block");
+    Node *node = parse_block(&parser, line);
+    trace_end("parse block");
+    int ret = node == (Node *) -1 ? -1 : run_nodes(node, root, &arena);
+    arena_free(&arena);
+    arena_free(&block_arena);
+    return ret;
+}
+
+
+/* test and [ */
+
+typedef struct TestArgs {
+    char **args;
+    size_t pos;
+    size_t end;
+    const char *error;
+} TestArgs;
+
+static int is_unary_op(const char *arg){
+    return arg[0] == '-' && arg[1] != '\0' && arg[2] == '\0' &&
+        strchr("bcdefhLnprsSwxz", arg[1]) != NULL;
+}
+
+static int is_binary_op(const char *arg){
+    static const char *ops[] = {"=", "==", "!=", "-eq", "-ne", "-lt", "-le",
+                                "-gt", "-ge", NULL};
+    for (size_t i = 0; ops[i] != NULL; i++){
+        if (strcmp(arg, ops[i]) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test_unary(char op, const char *arg){
+    struct stat st;
+    switch (op){
+    case 'n': return *arg != '\0';
+    case 'z': return *arg == '\0';
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 'h':
+    case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (stat(arg, &st) != 0){
+        return 0;
+    }
+    switch (op){
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'f': return S_ISREG(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 's': return st.st_size > 0;
+    default: return 1;
+    }
+}
+
+static int parse_integer(TestArgs *t, const char *arg, long *value){
+    char *end;
+    errno = 0;
+    *value = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno != 0){
+        t->error = "integer expression expected";
+        return -1;
+    }
+    return 0;
+}
+
+static int test_binary(TestArgs *t, const char *left, const char *op,
+                       const char *right){
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0){
+        return strcmp(left, right) == 0;
+    }
+    if (strcmp(op, "!=") == 0){
+        return strcmp(left, right) != 0;
+    }
+    long a, b;
+    if (parse_integer(t, left, &a) < 0 || parse_integer(t, right, &b) < 0){
+        return 0;
+    }
+    if (strcmp(op, "-eq") == 0) return a == b;
+    if (strcmp(op, "-ne") == 0) return a != b;
+    if (strcmp(op, "-lt") == 0) return a < b;
+    if (strcmp(op, "-le") == 0) return a <= b;
+    if (strcmp(op, "-gt") == 0) return a > b;
+    return a >= b;
+}
+
+static int test_or(TestArgs *t);
+
+static int test_primary(TestArgs *t){
+    size_t left = t->end - t->pos;
+    if (left == 0){
+        t->error = "argument expected";
+        return 0;
+    }
+    char **args = t->args + t->pos;
+    if (left >= 3 && is_binary_op(args[1])){
+        t->pos += 3;
+        return test_binary(t, args[0], args[1], args[2]);
+    }
+    if (left >= 2 && strcmp(args[0], "!") == 0){
+        t->pos++;
+        return !test_primary(t);
+    }
+    if (left >= 2 && strcmp(args[0], "(") == 0){
+        t->pos++;
+        int value = test_or(t);
+        if (t->pos >= t->end || strcmp(t->args[t->pos], ")") != 0){
+            t->error = "')' expected";
+            return 0;
+        }
+        t->pos++;
+        return value;
+    }
+    if (left >= 2 && is_unary_op(args[0])){
+        t->pos += 2;
+        return test_unary(args[0][1], args[1]);
+    }
+    t->pos++;
+    return args[0][0] != '\0';
+}
+
+static int test_and(TestArgs *t){
+    int value = test_primary(t);
+    while (t->error == NULL && t->pos < t->end && strcmp(t->args[t->pos], "-a") == 0){
+        t->pos++;
+        value = test_primary(t) && value;
+    }
+    return value;
+}
+
+static int test_or(TestArgs *t){
+    int value = test_and(t);
+    while (t->error == NULL && t->pos < t->end && strcmp(t->args[t->pos], "-o") == 0){
+        t->pos++;
+        value = test_and(t) || value;
+    }
+    return value;
+}
+
+// test EXPRESSION, [ EXPRESSION ]: 0 if true, 1 if false, 2 on error
+int test_builtin(char **args, int in_fd, int out_fd){
+    (void) in_fd;
+    (void) out_fd;
+    size_t argc = 0;
+    while (args[argc] != NULL){
+        argc++;
+    }
+    if (strcmp(args[0], "[") == 0){
+        if (strcmp(args[argc - 1], "]") != 0){
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+
+    TestArgs t = {args, 1, argc, NULL};
+    if (t.end == 1){
+        return 1;
+    }
+    int value = test_or(&t);
+    if (t.error == NULL && t.pos != t.end){
+        t.error = "too many arguments";
+    }
+    if (t.error != NULL){
+        fprintf(stderr, "%s: %s\n", args[0], t.error);
+        return 2;
+    }
+    return value ? 0 : 1;
+}
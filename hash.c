@@ -0,0 +1,423 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+/*
+** The command hash table: a bash-style cache mapping a command name to
+** the absolute path it resolved to. Entries are filled lazily by
+** hash_resolve and live in an open-addressing table (linear probing,
+** power of two capacity).
+**
+** Each entry remembers which PATH directory it was found in. Because a
+** new file in an earlier directory could shadow it, a hit is only
+** trusted if every directory up to and including that one still has
+** the mtime we recorded. Any change to the PATH string itself flushes
+** the whole table.
+*/
+typedef struct HashedCommand {
+    char *name;
+    char *path;
+    size_t dir_index;
+    unsigned int hits;
+} HashedCommand;
+
+typedef struct PathDir {
+    char *dir;
+    struct timespec mtime;
+    uint8_t valid;
+} PathDir;
+
+static HashedCommand *table = NULL;
+static size_t table_cap = 0;
+static size_t table_count = 0;
+
+static char *cached_path_value = NULL;
+static PathDir *path_dirs = NULL;
+static size_t num_path_dirs = 0;
+
+// whether the persistent index has been checked against path_dirs
+static uint8_t pathidx_synced = 0;
+
+
+// FNV-1a, good enough for short names
+size_t hash_bytes(const char *bytes, size_t len){
+    size_t h = 2166136261u;
+    const unsigned char *p = (const unsigned char *) bytes;
+    for (size_t i = 0; i < len; i++){
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void flush_table(){
+    for (size_t i = 0; i < table_cap; i++){
+        free(table[i].name);
+        free(table[i].path);
+    }
+    if (table != NULL){
+        memset(table, 0, table_cap * sizeof(HashedCommand));
+    }
+    table_count = 0;
+}
+
+static void free_path_dirs(){
+    for (size_t i = 0; i < num_path_dirs; i++){
+        free(path_dirs[i].dir);
+    }
+    free(path_dirs);
+    path_dirs = NULL;
+    num_path_dirs = 0;
+    free(cached_path_value);
+    cached_path_value = NULL;
+    pathidx_synced = 0;
+}
+
+static int stat_dir_mtime(const char *dir, struct timespec *mtime){
+    struct stat st;
+    if (stat(dir, &st) < 0){
+        return -1;
+    }
+    *mtime = st.st_mtim;
+    return 0;
+}
+
+/*
+** Splits the PATH value into path_dirs and records each directory's
+** current mtime. Returns 0 on success, -1 on allocation failure.
+*/
+static int load_path_dirs(const char *path_value){
+    free_path_dirs();
+
+    cached_path_value = strdup(path_value);
+    char *path_to_toke = strdup(path_value);
+    if (cached_path_value == NULL || path_to_toke == NULL){
+        perror("hash");
+        free(path_to_toke);
+        return -1;
+    }
+
+    size_t cap = 1;
+    for (const char *p = path_value; *p; p++){
+        if (*p == ':') cap++;
+    }
+    path_dirs = calloc(cap, sizeof(PathDir));
+    if (path_dirs == NULL){
+        perror("hash");
+        free(path_to_toke);
+        return -1;
+    }
+
+    for (char *dir = strtok(path_to_toke, ":"); dir != NULL;
+         dir = strtok(NULL, ":")){
+        PathDir *pd = &path_dirs[num_path_dirs++];
+        pd->dir = strdup(dir);
+        pd->valid = (stat_dir_mtime(dir, &pd->mtime) == 0);
+    }
+
+    free(path_to_toke);
+    return 0;
+}
+
+/*
+** Checks that PATH directories [0, upto] still look the way they did
+** when we recorded them. Returns 1 if they are unchanged, 0 otherwise.
+*/
+static int path_dirs_unchanged(size_t upto){
+    for (size_t i = 0; i <= upto && i < num_path_dirs; i++){
+        struct timespec now;
+        uint8_t valid = (stat_dir_mtime(path_dirs[i].dir, &now) == 0);
+        if (valid != path_dirs[i].valid){
+            return 0;
+        }
+        if (valid && (now.tv_sec != path_dirs[i].mtime.tv_sec ||
+                      now.tv_nsec != path_dirs[i].mtime.tv_nsec)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+** Scans a single PATH directory for an entry named command_name.
+**
+** Returns a heap string "dir/command_name" on a match, NULL if the
+** directory has no such entry, or (char *) -1 if the directory could
+** not be read at all.
+*/
+static char *find_in_dir(const char *dir_path, const char *command_name){
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL){
+        ERR_PRINT(ERR_BAD_PATH, dir_path);
+        return (char *) -1;
+    }
+
+    char *exec_path = NULL;
+    struct dirent *possible_file;
+
+    while (exec_path == NULL) {
+        // rare case where we should do this -- see: man readdir
+        errno = 0;
+        possible_file = readdir(dir);
+        if (possible_file == NULL) {
+            if (errno > 0){
+                perror("hash");
+                closedir(dir);
+                return (char *) -1;
+            }
+            // end of files, break
+            break;
+        }
+
+        if (strcmp(possible_file->d_name, command_name) == 0){
+            // +1 null term, +1 possible missing '/'
+            size_t buflen = strlen(dir_path) +
+                strlen(command_name) + 1 + 1;
+            exec_path = (char *) malloc(buflen);
+            if (exec_path == NULL){
+                perror("hash");
+                break;
+            }
+            // also sets remaining buf to 0
+            strncpy(exec_path, dir_path, buflen);
+            if (dir_path[strlen(dir_path)-1] != '/'){
+                strncat(exec_path, "/", 2);
+            }
+            strncat(exec_path, command_name, strlen(command_name)+1);
+        }
+    }
+    closedir(dir);
+    return exec_path;
+}
+
+// returns the slot holding name, or the empty slot where it would go
+static HashedCommand *find_slot(const char *name){
+    size_t mask = table_cap - 1;
+    size_t i = hash_bytes(name, strlen(name)) & mask;
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0){
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+static int grow_table(){
+    size_t old_cap = table_cap;
+    HashedCommand *old = table;
+
+    table_cap = old_cap ? old_cap * 2 : HASH_INIT_SLOTS;
+    table = calloc(table_cap, sizeof(HashedCommand));
+    if (table == NULL){
+        perror("hash");
+        table = old;
+        table_cap = old_cap;
+        return -1;
+    }
+
+    for (size_t i = 0; i < old_cap; i++){
+        if (old[i].name != NULL){
+            *find_slot(old[i].name) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+static void insert_entry(const char *name, char *path, size_t dir_index){
+    // keep the load factor at or below 1/2
+    if ((table_count + 1) * 2 > table_cap && grow_table() < 0){
+        return;
+    }
+    HashedCommand *slot = find_slot(name);
+    if (slot->name == NULL){
+        slot->name = strdup(name);
+        if (slot->name == NULL){
+            return;
+        }
+        table_count++;
+    }
+    else{
+        free(slot->path);
+    }
+    slot->path = strdup(path);
+    slot->dir_index = dir_index;
+    slot->hits = 1;
+}
+
+/*
+** Looks command_name up in the persistent PATH index (see pathidx.c),
+** bringing the index up to date with path_dirs first if needed.
+**
+** Returns the PATH position it was found at (and the full path through
+** exec_path), -1 if it is on no PATH directory, or -2 if the index is
+** unavailable.
+*/
+static ssize_t index_resolve(const char *command_name, char **exec_path){
+    if (!pathidx_synced){
+        char **dirs = malloc((num_path_dirs ? num_path_dirs : 1) * sizeof(char *));
+        if (dirs == NULL){
+            return -2;
+        }
+        for (size_t i = 0; i < num_path_dirs; i++){
+            dirs[i] = path_dirs[i].dir;
+        }
+        int err = pathidx_sync(dirs, num_path_dirs);
+        free(dirs);
+        if (err < 0){
+            return -2;
+        }
+        pathidx_synced = 1;
+    }
+
+    ssize_t dir_index = pathidx_lookup(command_name);
+    if (dir_index < 0){
+        return dir_index;
+    }
+
+    const char *dir = path_dirs[dir_index].dir;
+    size_t dir_len = strlen(dir);
+    size_t buflen = dir_len + strlen(command_name) + 2;
+    *exec_path = malloc(buflen);
+    if (*exec_path == NULL){
+        perror("hash");
+        return -2;
+    }
+    snprintf(*exec_path, buflen, "%s%s%s", dir,
+             (dir_len > 0 && dir[dir_len - 1] == '/') ? "" : "/", command_name);
+    return dir_index;
+}
+
+
+char *hash_resolve(const char *command_name, Variable *path){
+
+    if (command_name == NULL || path == NULL){
+        return NULL;
+    }
+
+    // names with a '/' and cd are never hashed
+    if (strchr(command_name, '/') || strcmp(command_name, CD) == 0){
+        return resolve_executable(command_name, path);
+    }
+
+    if (strcmp(path->name, PATH_VAR_NAME) != 0){
+        ERR_PRINT(ERR_NOT_PATH);
+        return NULL;
+    }
+
+    if (cached_path_value == NULL ||
+        strcmp(cached_path_value, path->value) != 0){
+        flush_table();
+        if (load_path_dirs(path->value) < 0){
+            return NULL;
+        }
+    }
+
+    if (table_cap > 0){
+        HashedCommand *slot = find_slot(command_name);
+        if (slot->name != NULL){
+            if (path_dirs_unchanged(slot->dir_index)){
+                slot->hits++;
+                return strdup(slot->path);
+            }
+            // something on PATH moved under us, start over
+            flush_table();
+            if (load_path_dirs(path->value) < 0){
+                return NULL;
+            }
+        }
+    }
+
+    if (pathidx_enabled()){
+        char *exec_path = NULL;
+        ssize_t dir_index = index_resolve(command_name, &exec_path);
+        // the index only knows what PATH held when it was synced
+        if (dir_index == -1 && !path_dirs_unchanged(num_path_dirs - 1)){
+            flush_table();
+            if (load_path_dirs(path->value) < 0){
+                return NULL;
+            }
+            dir_index = index_resolve(command_name, &exec_path);
+        }
+        if (dir_index >= 0){
+            insert_entry(command_name, exec_path, dir_index);
+            return exec_path;
+        }
+        if (dir_index == -1){
+            return NULL;
+        }
+        // the index could not be used, scan like we always did
+    }
+
+    for (size_t i = 0; i < num_path_dirs; i++){
+        char *exec_path = find_in_dir(path_dirs[i].dir, command_name);
+        if (exec_path == (char *) -1){
+            continue;
+        }
+        if (exec_path != NULL){
+            insert_entry(command_name, exec_path, i);
+            return exec_path;
+        }
+    }
+    return NULL;
+}
+
+
+int hash_builtin(char **args, int in_fd, int out_fd){
+    (void) in_fd;
+    if (args[1] != NULL){
+        if (strcmp(args[1], "-r") == 0 && args[2] == NULL){
+            flush_table();
+            pathidx_synced = 0;
+            return 0;
+        }
+        ERR_PRINT(ERR_HASH_USAGE);
+        return 1;
+    }
+
+    if (table_count == 0){
+        dprintf(out_fd, "hash: hash table empty\n");
+        return 0;
+    }
+
+    FILE *out = fdopen(dup(out_fd), "w");
+    if (out == NULL){
+        perror("hash");
+        return 1;
+    }
+    fprintf(out, "hits\tcommand\n");
+    for (size_t i = 0; i < table_cap; i++){
+        if (table[i].name != NULL){
+            fprintf(out, "%4u\t%s\n", table[i].hits, table[i].path);
+        }
+    }
+    fclose(out);
+    return 0;
+}
+
+
+size_t hash_names(char *buf, size_t cap){
+    size_t len = 0;
+    for (size_t i = 0; i < table_cap; i++){
+        if (table[i].name == NULL){
+            continue;
+        }
+        size_t name_len = strlen(table[i].name) + 1;
+        if (len + name_len > cap){
+            break;
+        }
+        memcpy(buf + len, table[i].name, name_len);
+        len += name_len;
+    }
+    return len;
+}
+
+
+void hash_free(){
+    flush_table();
+    free(table);
+    table = NULL;
+    table_cap = 0;
+    free_path_dirs();
+}
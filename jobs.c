@@ -0,0 +1,341 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+#include <signal.h>
+
+/*
+** Background jobs. A line ending in & is started like any other, but
+** instead of waiting for it execute_line hands its pids to jobs_add.
+** The SIGCHLD handler reaps the stages of running jobs itself, with
+** WNOHANG waits on their pids only, so it can never steal the status of
+** a foreground child; it just leaves the status with the stage, and
+** jobs_reap (at the start of the next line, or in jobs and wait) books
+** it. Whatever changes the list blocks SIGCHLD while it does. A finished
+** stage keeps its pid negated, so wait can still find it.
+**
+** Finished jobs stay on the list until jobs or wait report them, but
+** only the last JOBS_MAX_FINISHED of them, so a script that starts a
+** job on every line does not grow the list forever.
+*/
+#define JOBS_MAX_FINISHED 256
+
+typedef struct Job {
+    int id;
+    pid_t *pids;
+    int *wstatus;
+    volatile sig_atomic_t *reaped;
+    size_t num_pids;
+    size_t num_running;
+    uint8_t status_known;
+    int status;
+    char *text;
+    struct Job *next;
+} Job;
+
+static Job *jobs_head = NULL;
+static Job *jobs_tail = NULL;
+static size_t num_finished = 0;
+static volatile sig_atomic_t children_exited = 0;
+
+static void sigchld_handler(int sig){
+    (void) sig;
+    int saved_errno = errno;
+    for (Job *job = jobs_head; job != NULL; job = job->next){
+        for (size_t i = 0; i < job->num_pids; i++){
+            if (job->pids[i] > 0 && !job->reaped[i] &&
+                waitpid(job->pids[i], &job->wstatus[i], WNOHANG) > 0){
+                job->reaped[i] = 1;
+                children_exited = 1;
+            }
+        }
+    }
+    errno = saved_errno;
+}
+
+static void block_sigchld(sigset_t *old){
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, old);
+}
+
+static void restore_sigchld(sigset_t *old){
+    sigprocmask(SIG_SETMASK, old, NULL);
+}
+
+// records that pid (the idx'th stage of job) has finished with status
+static void job_pid_done(Job *job, size_t idx, int status){
+    trace_child_exited(job->pids[idx], status);
+    job->pids[idx] = -job->pids[idx];
+    if (--job->num_running == 0){
+        num_finished++;
+    }
+    if (idx == job->num_pids - 1 && !job->status_known){
+        job->status = status_to_exit_code(status);
+    }
+}
+
+// blocks until every stage of job has finished; SIGCHLD must be blocked
+static void job_wait(Job *job){
+    for (size_t i = 0; i < job->num_pids; i++){
+        if (job->pids[i] < 0){
+            continue;
+        }
+        int status = job->wstatus[i];
+        pid_t pid = 0;
+        while (!job->reaped[i] &&
+               (pid = waitpid(job->pids[i], &status, 0)) == -1 && errno == EINTR){}
+        if (pid == -1){
+            perror("wait");
+            status = 0;
+        }
+        job_pid_done(job, i, status);
+    }
+}
+
+static void job_remove(Job *job){
+    Job *prev = NULL;
+    for (Job *curr = jobs_head; curr != job; curr = curr->next){
+        prev = curr;
+    }
+    if (prev == NULL){
+        jobs_head = job->next;
+    }
+    else {
+        prev->next = job->next;
+    }
+    if (jobs_tail == job){
+        jobs_tail = prev;
+    }
+    if (job->num_running == 0){
+        num_finished--;
+    }
+    free(job->pids);
+    free(job->wstatus);
+    free((void *) job->reaped);
+    free(job->text);
+    free(job);
+}
+
+// the command line as the user would have typed it, without the &
+static char *job_text(Command *head){
+    size_t len = 1;
+    for (Command *cmd = head; cmd != NULL; cmd = cmd->next){
+        for (size_t i = 0; cmd->args[i] != NULL; i++){
+            len += strlen(cmd->args[i]) + 1;
+        }
+        len += 2;
+    }
+    char *text = malloc(len);
+    if (text == NULL){
+        return NULL;
+    }
+    char *out = text;
+    for (Command *cmd = head; cmd != NULL; cmd = cmd->next){
+        for (size_t i = 0; cmd->args[i] != NULL; i++){
+            out += sprintf(out, i ? " %s" : "%s", cmd->args[i]);
+        }
+        if (cmd->next != NULL){
+            out += sprintf(out, " | ");
+        }
+    }
+    *out = '\0';
+    return text;
+}
+
+
+void jobs_init(){
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigchld_handler;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGCHLD, &action, NULL) == -1){
+        perror("sigaction");
+    }
+}
+
+
+int jobs_add(Command *head, pid_t *pids, size_t num_pids, int status){
+    Job *job = calloc(1, sizeof(Job));
+    if (job != NULL){
+        job->pids = malloc(num_pids * sizeof(pid_t));
+        job->wstatus = calloc(num_pids, sizeof(int));
+        job->reaped = calloc(num_pids, sizeof(sig_atomic_t));
+    }
+    if (job == NULL || job->pids == NULL || job->wstatus == NULL || job->reaped == NULL){
+        perror("jobs_add");
+        if (job != NULL){
+            free(job->pids);
+            free(job->wstatus);
+            free((void *) job->reaped);
+        }
+        free(job);
+        return -1;
+    }
+    memcpy(job->pids, pids, num_pids * sizeof(pid_t));
+    job->num_pids = num_pids;
+    job->num_running = num_pids;
+    job->text = job_text(head);
+    job->status_known = status >= 0;
+    job->status = status >= 0 ? status : 0;
+    job->id = jobs_tail ? jobs_tail->id + 1 : 1;
+
+    sigset_t old;
+    block_sigchld(&old);
+    if (jobs_tail == NULL){
+        jobs_head = job;
+    }
+    else {
+        jobs_tail->next = job;
+    }
+    jobs_tail = job;
+    restore_sigchld(&old);
+    // a stage may have exited before the handler could see its job
+    raise(SIGCHLD);
+    return job->id;
+}
+
+
+void jobs_reap(){
+    if (!children_exited){
+        return;
+    }
+    sigset_t old;
+    block_sigchld(&old);
+    children_exited = 0;
+
+    for (Job *job = jobs_head; job != NULL; job = job->next){
+        for (size_t i = 0; i < job->num_pids && job->num_running > 0; i++){
+            if (job->pids[i] > 0 && job->reaped[i]){
+                job_pid_done(job, i, job->wstatus[i]);
+            }
+        }
+    }
+
+    // the oldest finished jobs go first
+    Job *job = jobs_head;
+    while (num_finished > JOBS_MAX_FINISHED && job != NULL){
+        Job *next = job->next;
+        if (job->num_running == 0){
+            job_remove(job);
+        }
+        job = next;
+    }
+    restore_sigchld(&old);
+}
+
+
+int jobs_child_exited(pid_t pid, int status){
+    sigset_t old;
+    block_sigchld(&old);
+    for (Job *job = jobs_head; job != NULL; job = job->next){
+        for (size_t i = 0; i < job->num_pids; i++){
+            if (job->pids[i] == pid){
+                job_pid_done(job, i, status);
+                restore_sigchld(&old);
+                return 1;
+            }
+        }
+    }
+    restore_sigchld(&old);
+    return 0;
+}
+
+
+int jobs_builtin(char **args, int in_fd, int out_fd){
+    (void) in_fd;
+    (void) args;
+    sigset_t old;
+    block_sigchld(&old);
+    jobs_reap();
+
+    Job *job = jobs_head;
+    while (job != NULL){
+        Job *next = job->next;
+        if (job->num_running > 0){
+            dprintf(out_fd, "[%d]  Running\t\t%s\n", job->id, job->text);
+        }
+        // finished jobs are reported once, then forgotten
+        else {
+            if (job->status == 0){
+                dprintf(out_fd, "[%d]  Done\t\t%s\n", job->id, job->text);
+            }
+            else {
+                dprintf(out_fd, "[%d]  Exit %d\t\t%s\n", job->id, job->status, job->text);
+            }
+            job_remove(job);
+        }
+        job = next;
+    }
+    restore_sigchld(&old);
+    return 0;
+}
+
+
+/*
+** wait: waits for every job and returns 0. wait %N waits for job N and
+** wait PID for the job PID belongs to; both return the job's status, or
+** 127 if there is no such job.
+*/
+int wait_builtin(char **args, int in_fd, int out_fd){
+    (void) in_fd;
+    (void) out_fd;
+    // the handler must not reap what job_wait is waiting for
+    sigset_t old;
+    block_sigchld(&old);
+
+    if (args[1] == NULL){
+        while (jobs_head != NULL){
+            job_wait(jobs_head);
+            job_remove(jobs_head);
+        }
+        restore_sigchld(&old);
+        return 0;
+    }
+
+    int ret = 0;
+    for (size_t a = 1; args[a] != NULL; a++){
+        int by_id = args[a][0] == '%';
+        long target = strtol(args[a] + by_id, NULL, 10);
+
+        Job *job = jobs_head;
+        while (job != NULL){
+            if (by_id && job->id == target){
+                break;
+            }
+            int found = 0;
+            for (size_t i = 0; !by_id && i < job->num_pids; i++){
+                found |= job->pids[i] == target || -job->pids[i] == target;
+            }
+            if (found){
+                break;
+            }
+            job = job->next;
+        }
+        if (job == NULL){
+            fprintf(stderr, "wait: %s: no such job\n", args[a]);
+            ret = 127;
+            continue;
+        }
+        job_wait(job);
+        ret = job->status;
+        job_remove(job);
+    }
+    restore_sigchld(&old);
+    return ret;
+}
+
+
+void jobs_free(){
+    sigset_t old;
+    block_sigchld(&old);
+    while (jobs_head != NULL){
+        job_remove(jobs_head);
+    }
+    restore_sigchld(&old);
+}
@@ -0,0 +1,221 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+/*
+** The lexer makes a single pass over a line and describes it as a list
+** of Token spans into the line itself; nothing is copied. Words may mix
+** bare text, 'single quoted' text (taken literally), "double quoted"
+** text (where \ escapes ", \, $ and `) and \-escaped characters. The
+** operators |, <, >, >> and & end a word, and an unquoted # at the start
+** of a word starts a comment that runs to the end of the line. A $(...)
+** command substitution is part of the word it is in, spaces, operators
+** and all.
+*/
+
+#define TOKENS_INIT 16
+
+static int is_operator_char(char c){
+    return c == '|' || c == '<' || c == '>' || c == '&';
+}
+
+static void push_token(TokenList *list, TokenKind kind, size_t offset,
+                       size_t length, uint8_t quoted, Arena *arena){
+    if (list->count == list->cap){
+        size_t new_cap = list->cap ? list->cap * 2 : TOKENS_INIT;
+        Token *grown = arena_alloc(arena, new_cap * sizeof(Token));
+        if (list->count > 0){
+            memcpy(grown, list->tokens, list->count * sizeof(Token));
+        }
+        list->tokens = grown;
+        list->cap = new_cap;
+    }
+    Token *tok = &list->tokens[list->count++];
+    tok->offset = offset;
+    tok->length = length;
+    tok->kind = kind;
+    tok->quoted = quoted;
+}
+
+
+const char *substitution_end(const char *open){
+    int depth = 1;
+    const char *p = open + 1;
+    while (*p != '\0'){
+        if (*p == '\\' && p[1] != '\0'){
+            p += 2;
+        }
+        else if (*p == '\''){
+            p = strchr(p + 1, '\'');
+            if (p == NULL){
+                return NULL;
+            }
+            p++;
+        }
+        else if (*p == '"'){
+            p++;
+            while (*p != '\0' && *p != '"'){
+                p += (*p == '\\' && p[1] != '\0') ? 2 : 1;
+            }
+            if (*p == '\0'){
+                return NULL;
+            }
+            p++;
+        }
+        else if (*p == ')' && --depth == 0){
+            return p;
+        }
+        else {
+            depth += *p == '(';
+            p++;
+        }
+    }
+    return NULL;
+}
+
+// the index just past the $(...) starting at line[i], or 0 (after
+// printing an error) if it is never closed
+static size_t skip_substitution(const char *line, size_t i){
+    const char *close = substitution_end(line + i + 1);
+    if (close == NULL){
+        ERR_PRINT(ERR_UNTERMINATED, ')');
+        return 0;
+    }
+    return close - line + 1;
+}
+
+
+int lex_line(const char *line, TokenList *list, Arena *arena){
+    memset(list, 0, sizeof(TokenList));
+    size_t i = 0;
+
+    while (line[i] != '\0'){
+        char c = line[i];
+
+        if (isspace((unsigned char) c)){
+            i++;
+            continue;
+        }
+
+        if (c == '#'){
+            break;
+        }
+
+        if (c == '|'){
+            push_token(list, TOK_PIPE, i, 1, 0, arena);
+            i++;
+            continue;
+        }
+        if (c == '&'){
+            push_token(list, TOK_BACKGROUND, i, 1, 0, arena);
+            i++;
+            continue;
+        }
+        if (c == '<'){
+            push_token(list, TOK_REDIR_IN, i, 1, 0, arena);
+            i++;
+            continue;
+        }
+        if (c == '>'){
+            if (line[i + 1] == '>'){
+                push_token(list, TOK_REDIR_APPEND, i, 2, 0, arena);
+                i += 2;
+            }
+            else {
+                push_token(list, TOK_REDIR_OUT, i, 1, 0, arena);
+                i++;
+            }
+            continue;
+        }
+
+        // a word: runs until unquoted whitespace or an operator
+        size_t start = i;
+        uint8_t quoted = 0;
+        while (line[i] != '\0' && !isspace((unsigned char) line[i]) &&
+               !is_operator_char(line[i])){
+            if (line[i] == '\\'){
+                quoted = 1;
+                i += line[i + 1] != '\0' ? 2 : 1;
+            }
+            else if (line[i] == VARIABLE_PARSE_MARKER && line[i + 1] == '('){
+                quoted = 1;
+                if ((i = skip_substitution(line, i)) == 0){
+                    return -1;
+                }
+            }
+            else if (line[i] == '\''){
+                quoted = 1;
+                const char *close = strchr(line + i + 1, '\'');
+                if (close == NULL){
+                    ERR_PRINT(ERR_UNTERMINATED, '\'');
+                    return -1;
+                }
+                i = close - line + 1;
+            }
+            else if (line[i] == '"'){
+                quoted = 1;
+                i++;
+                while (line[i] != '\0' && line[i] != '"'){
+                    if (line[i] == VARIABLE_PARSE_MARKER && line[i + 1] == '('){
+                        if ((i = skip_substitution(line, i)) == 0){
+                            return -1;
+                        }
+                        continue;
+                    }
+                    i += (line[i] == '\\' && line[i + 1] != '\0') ? 2 : 1;
+                }
+                if (line[i] != '"'){
+                    ERR_PRINT(ERR_UNTERMINATED, '"');
+                    return -1;
+                }
+                i++;
+            }
+            else {
+                i++;
+            }
+        }
+        push_token(list, TOK_WORD, start, i - start, quoted, arena);
+    }
+
+    list->end = i;
+    return 0;
+}
+
+
+size_t dequote(char *dst, const char *src, size_t len){
+    size_t out = 0;
+    size_t i = 0;
+
+    while (i < len){
+        char c = src[i];
+        if (c == '\\' && i + 1 < len){
+            dst[out++] = src[i + 1];
+            i += 2;
+        }
+        else if (c == '\''){
+            i++;
+            while (i < len && src[i] != '\''){
+                dst[out++] = src[i++];
+            }
+            i++;
+        }
+        else if (c == '"'){
+            i++;
+            while (i < len && src[i] != '"'){
+                if (src[i] == '\\' && i + 1 < len &&
+                    strchr("\"\\$`", src[i + 1]) != NULL){
+                    i++;
+                }
+                dst[out++] = src[i++];
+            }
+            i++;
+        }
+        else {
+            dst[out++] = src[i++];
+        }
+    }
+    return out;
+}
@@ -0,0 +1,351 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+#include <poll.h>
+
+/*
+** The par builtin:
+**
+**     par [-j N] CMD [ARG]... ::: ITEM...
+**     par [-j N] CMD [ARG]...              (items are the lines of input)
+**
+** runs CMD once per item, with every {} in its arguments replaced by
+** the item (or the item appended if there is no {}), keeping at most N
+** children (default: the number of online CPUs) running at once.
+** Children are started with run_command, so they go through the same
+** launch path (and launch mode) as any other command; their stdin is
+** /dev/null. Each child's stdout goes into a pipe and is buffered, and
+** written out in one piece once the child is done, so the output of
+** different items never interleaves. stderr is not buffered.
+**
+** The status is the number of items that failed, capped at 101 (as in
+** GNU parallel), 0 if all of them succeeded.
+*/
+
+#define PAR_SEPARATOR ":::"
+#define PAR_PLACEHOLDER "{}"
+#define PAR_MAX_STATUS 101
+
+typedef struct ParChild {
+    pid_t pid;
+    int fd;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+} ParChild;
+
+// args with {} replaced by item, or item appended; NULL terminated
+static char **item_args(char **cmd_args, size_t num_args, const char *item){
+    char **args = malloc((num_args + 2) * sizeof(char *));
+    if (args == NULL){
+        return NULL;
+    }
+    size_t item_len = strlen(item);
+    int placed = 0;
+
+    for (size_t i = 0; i < num_args; i++){
+        const char *arg = cmd_args[i];
+        size_t count = 0;
+        for (const char *p = strstr(arg, PAR_PLACEHOLDER); p != NULL;
+             p = strstr(p + 2, PAR_PLACEHOLDER)){
+            count++;
+        }
+        args[i] = malloc(strlen(arg) + count * item_len + 1);
+        if (args[i] == NULL){
+            while (i-- > 0){
+                free(args[i]);
+            }
+            free(args);
+            return NULL;
+        }
+
+        char *out = args[i];
+        const char *p;
+        while ((p = strstr(arg, PAR_PLACEHOLDER)) != NULL){
+            memcpy(out, arg, p - arg);
+            out += p - arg;
+            memcpy(out, item, item_len);
+            out += item_len;
+            arg = p + 2;
+        }
+        strcpy(out, arg);
+        placed |= count > 0;
+    }
+    args[num_args] = placed ? NULL : strdup(item);
+    args[num_args + 1] = NULL;
+    return args;
+}
+
+static void free_args(char **args){
+    for (size_t i = 0; args[i] != NULL; i++){
+        free(args[i]);
+    }
+    free(args);
+}
+
+// every non-empty line of in_fd, in a heap buffer split in place
+static char **read_items(int in_fd, size_t *num_items, char **storage){
+    size_t len = 0;
+    size_t cap = READER_BUF_SIZE;
+    char *buf = malloc(cap);
+    ssize_t n;
+    while (buf != NULL){
+        if (len + 1 == cap){
+            char *grown = realloc(buf, cap * 2);
+            if (grown == NULL){
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+        n = read(in_fd, buf + len, cap - len - 1);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            break;
+        }
+        len += n;
+    }
+    if (buf == NULL){
+        perror("par");
+        return NULL;
+    }
+    buf[len] = '\0';
+
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++){
+        count += buf[i] == '\n';
+    }
+    char **items = malloc((count + 1) * sizeof(char *));
+    if (items == NULL){
+        perror("par");
+        free(buf);
+        return NULL;
+    }
+    *num_items = 0;
+    for (char *line = strtok(buf, "\n"); line != NULL; line = strtok(NULL, "\n")){
+        items[(*num_items)++] = line;
+    }
+    *storage = buf;
+    return items;
+}
+
+// reads what child has ready; returns 0 at end of its output
+static int drain(ParChild *child){
+    if (child->out_cap - child->out_len < READER_BUF_SIZE){
+        size_t new_cap = child->out_cap ? child->out_cap * 2 : READER_BUF_SIZE * 2;
+        char *grown = realloc(child->out, new_cap);
+        if (grown == NULL){
+            perror("par");
+            return 0;
+        }
+        child->out = grown;
+        child->out_cap = new_cap;
+    }
+    ssize_t n = read(child->fd, child->out + child->out_len,
+                     child->out_cap - child->out_len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)){
+        return 1;
+    }
+    if (n <= 0){
+        return 0;
+    }
+    child->out_len += n;
+    return 1;
+}
+
+// starts one item; returns 0 on success, 1 if the item failed to start
+// (counted as a failure), -1 if no more children can be started
+static int start_item(ParChild *child, char **args){
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1){
+        perror("pipe");
+        return -1;
+    }
+
+    Command command;
+    memset(&command, 0, sizeof(Command));
+    command.args = args;
+    command.stdin_fd = STDIN_FILENO;
+    command.stdout_fd = pipe_fds[1];
+    command.redir_in_path = "/dev/null";
+
+    VarTable *vars = builtin_variables();
+    char *resolved = hash_resolve(args[0], vars ? vars->path : NULL);
+    if (resolved == NULL){
+        ERR_PRINT(ERR_NO_EXECU, args[0]);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return 1;
+    }
+    command.exec_path = resolved;
+    pid_t pid = run_command(&command);
+    free(resolved);
+    close(pipe_fds[1]);
+
+    if (pid <= 0){
+        close(pipe_fds[0]);
+        return pid == 0 ? 1 : -1;
+    }
+    memset(child, 0, sizeof(ParChild));
+    child->pid = pid;
+    child->fd = pipe_fds[0];
+    return 0;
+}
+
+
+int par_builtin(char **args, int in_fd, int out_fd){
+    long max_children = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t a = 1;
+    if (args[a] != NULL && strcmp(args[a], "-j") == 0){
+        if (args[a + 1] == NULL || (max_children = atol(args[a + 1])) < 1){
+            ERR_PRINT(ERR_PAR_USAGE);
+            return 2;
+        }
+        a += 2;
+    }
+    if (max_children < 1){
+        max_children = 1;
+    }
+
+    char **cmd_args = args + a;
+    size_t num_args = 0;
+    while (cmd_args[num_args] != NULL && strcmp(cmd_args[num_args], PAR_SEPARATOR) != 0){
+        num_args++;
+    }
+    if (num_args == 0){
+        ERR_PRINT(ERR_PAR_USAGE);
+        return 2;
+    }
+
+    char **items;
+    size_t num_items = 0;
+    char *storage = NULL;
+    if (cmd_args[num_args] != NULL){
+        items = cmd_args + num_args + 1;
+        while (items[num_items] != NULL){
+            num_items++;
+        }
+    }
+    else if ((items = read_items(in_fd, &num_items, &storage)) == NULL){
+        return 1;
+    }
+
+    ParChild *children = calloc(max_children, sizeof(ParChild));
+    struct pollfd *fds = calloc(max_children, sizeof(struct pollfd));
+    if (children == NULL || fds == NULL){
+        perror("par");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t next_item = 0;
+    long running = 0;
+    int failed = 0;
+    int stop = 0;
+
+    while (running > 0 || (next_item < num_items && !stop)){
+        // fill every free slot
+        for (long c = 0; c < max_children && next_item < num_items && !stop; c++){
+            if (children[c].pid != 0){
+                continue;
+            }
+            char **item = item_args(cmd_args, num_args, items[next_item++]);
+            if (item == NULL){
+                perror("par");
+                stop = 1;
+                break;
+            }
+            int started = start_item(&children[c], item);
+            free_args(item);
+            if (started < 0){
+                stop = 1;
+            }
+            failed += started != 0;
+            running += started == 0;
+        }
+        if (running == 0){
+            continue;
+        }
+
+        nfds_t nfds = 0;
+        for (long c = 0; c < max_children; c++){
+            if (children[c].pid != 0){
+                fds[nfds].fd = children[c].fd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                nfds++;
+            }
+        }
+        if (poll(fds, nfds, -1) == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            perror("poll");
+            // nothing more can be read: collect the rest and fail
+            for (long c = 0; c < max_children; c++){
+                ParChild *child = &children[c];
+                if (child->pid == 0){
+                    continue;
+                }
+                close(child->fd);
+                int status;
+                while (waitpid(child->pid, &status, 0) == -1 && errno == EINTR){}
+                trace_child_exited(child->pid, status);
+                free(child->out);
+                memset(child, 0, sizeof(ParChild));
+                failed++;
+            }
+            failed += failed == 0;
+            break;
+        }
+
+        for (long c = 0, f = 0; c < max_children; c++){
+            ParChild *child = &children[c];
+            if (child->pid == 0){
+                continue;
+            }
+            short revents = fds[f++].revents;
+            if (revents == 0 || drain(child)){
+                continue;
+            }
+
+            // the child closed its output: collect it and pass it on
+            close(child->fd);
+            int status;
+            while (waitpid(child->pid, &status, 0) == -1 && errno == EINTR){}
+            trace_child_exited(child->pid, status);
+            failed += status_to_exit_code(status) != 0;
+            if (child->out_len > 0){
+                fflush(stdout);
+                for (size_t off = 0; off < child->out_len;){
+                    ssize_t n = write(out_fd, child->out + off, child->out_len - off);
+                    if (n < 0 && errno == EINTR){
+                        continue;
+                    }
+                    if (n < 0){
+                        break;
+                    }
+                    off += n;
+                }
+            }
+            free(child->out);
+            memset(child, 0, sizeof(ParChild));
+            running--;
+        }
+    }
+
+    free(children);
+    free(fds);
+    if (storage != NULL){
+        free(items);
+        free(storage);
+    }
+    return failed > PAR_MAX_STATUS ? PAR_MAX_STATUS : failed;
+}
@@ -0,0 +1,332 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+/*
+** Parallel scripts (cscshell -j N). Lines are still read, compiled and
+** expanded in order, but a line that only runs external commands is
+** started without waiting for it, as long as fewer than N lines are in
+** flight. Everything that could observe or change the shell's state is
+** a barrier that waits for every line in flight and then runs like it
+** would in run_script: assignments, background lines, timed lines,
+** lines with a builtin in them (cd among them), lines that use $?,
+** $! or $(...), and if, while and for blocks. A $(...) runs before
+** its line is started, so those lines wait before they are expanded.
+** Before a barrier goes on, $? is set to the status of the line that
+** was started last, which is the line a serial run would have run last.
+**
+** Lines are also ordered by the files they name. A line waits for any
+** line in flight that writes (redirects into) a file it reads or
+** writes, or that reads a file it writes. A file counts as read when it
+** is redirected from or appears as an argument.
+*/
+
+typedef struct Slot {
+    pid_t *pids;
+    size_t num_pids;
+    size_t num_running;
+    size_t seq;
+    int status;
+    char **reads;
+    char **writes;
+} Slot;
+
+static int max_jobs = 1;
+
+// lines started so far, and the status of the last one once it is done
+static size_t lines_started = 0;
+static int last_status = 0;
+static uint8_t status_pending = 0;
+
+void set_parallel_jobs(int jobs){
+    max_jobs = jobs;
+}
+
+int parallel_jobs(){
+    return max_jobs;
+}
+
+
+static int word_uses_status(const Word *word){
+    for (size_t i = 0; i < word->num_parts; i++){
+        const WordPart *part = &word->parts[i];
+        if (part->kind == PART_COMMAND){
+            return 1;
+        }
+        if (part->kind == PART_VARIABLE && part->len == 1 &&
+            (part->text[0] == '?' || part->text[0] == '!')){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// does any word of the template expand $? or $!, or run a command
+static int uses_status(const LineTemplate *tmpl){
+    for (size_t s = 0; s < tmpl->num_stages; s++){
+        const StageTemplate *stage = &tmpl->stages[s];
+        for (size_t w = 0; w < stage->num_words; w++){
+            if (word_uses_status(&stage->words[w])){
+                return 1;
+            }
+        }
+        if ((stage->redir_in && word_uses_status(stage->redir_in)) ||
+            (stage->redir_out && word_uses_status(stage->redir_out))){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int has_builtin(Command *head){
+    for (Command *cmd = head; cmd != NULL; cmd = cmd->next){
+        if (is_builtin(cmd->exec_path)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// a NULL terminated heap array of strdup'd paths
+static char **collect_paths(Command *head, int writes){
+    size_t count = 1;
+    for (Command *cmd = head; cmd != NULL; cmd = cmd->next){
+        for (size_t i = 1; !writes && cmd->args[i] != NULL; i++){
+            count++;
+        }
+        count++;
+    }
+    char **paths = malloc(count * sizeof(char *));
+    if (paths == NULL){
+        perror("run_script");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t n = 0;
+    for (Command *cmd = head; cmd != NULL; cmd = cmd->next){
+        if (writes){
+            if (cmd->redir_out_path != NULL){
+                paths[n++] = strdup(cmd->redir_out_path);
+            }
+            continue;
+        }
+        if (cmd->redir_in_path != NULL){
+            paths[n++] = strdup(cmd->redir_in_path);
+        }
+        for (size_t i = 1; cmd->args[i] != NULL; i++){
+            paths[n++] = strdup(cmd->args[i]);
+        }
+    }
+    paths[n] = NULL;
+    return paths;
+}
+
+static int paths_overlap(char **a, char **b){
+    for (size_t i = 0; a[i] != NULL; i++){
+        for (size_t j = 0; b[j] != NULL; j++){
+            if (strcmp(a[i], b[j]) == 0){
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void free_paths(char **paths){
+    for (size_t i = 0; paths[i] != NULL; i++){
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+static void slot_free(Slot *slot){
+    free(slot->pids);
+    free_paths(slot->reads);
+    free_paths(slot->writes);
+    memset(slot, 0, sizeof(Slot));
+}
+
+/*
+** Waits for one child of the shell to exit and updates whichever slot
+** it belongs to; a slot whose last pipeline stage is gone is freed.
+** Children that belong to background jobs are passed on to jobs.c.
+** Returns -1 if there was nothing left to wait for.
+*/
+static int wait_any(Slot *slots, size_t *num_busy){
+    int status;
+    pid_t pid;
+    trace_begin("waitpid");
+    while ((pid = waitpid(-1, &status, 0)) == -1 && errno == EINTR){}
+    trace_end("waitpid");
+    if (pid == -1){
+        return -1;
+    }
+
+    for (int s = 0; s < max_jobs; s++){
+        Slot *slot = &slots[s];
+        for (size_t i = 0; slot->pids != NULL && i < slot->num_pids; i++){
+            if (slot->pids[i] != pid){
+                continue;
+            }
+            trace_child_exited(pid, status);
+            slot->pids[i] = 0;
+            if (i == slot->num_pids - 1){
+                slot->status = status_to_exit_code(status);
+            }
+            if (--slot->num_running == 0){
+                if (slot->seq == lines_started){
+                    last_status = slot->status;
+                    status_pending = 1;
+                }
+                slot_free(slot);
+                (*num_busy)--;
+            }
+            return 0;
+        }
+    }
+    jobs_child_exited(pid, status);
+    return 0;
+}
+
+static void wait_all(Slot *slots, size_t *num_busy){
+    while (*num_busy > 0 && wait_any(slots, num_busy) == 0){}
+    if (status_pending){
+        set_status_variable("?", last_status);
+        status_pending = 0;
+    }
+}
+
+// is any line in flight ordered before one with these reads and writes
+static int conflicts(Slot *slots, char **reads, char **writes){
+    for (int s = 0; s < max_jobs; s++){
+        Slot *slot = &slots[s];
+        if (slot->pids == NULL){
+            continue;
+        }
+        if (paths_overlap(reads, slot->writes) ||
+            paths_overlap(writes, slot->writes) ||
+            paths_overlap(writes, slot->reads)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+int run_script_parallel(ScriptReader *reader, VarTable *root){
+    Slot *slots = calloc(max_jobs, sizeof(Slot));
+    if (slots == NULL){
+        perror("run_script");
+        return -1;
+    }
+    size_t num_busy = 0;
+    Arena arena = {0};
+    int ret = 1;
+
+    char *line;
+    while ((line = reader_next(reader)) != NULL){
+        if (line == (char *) -1){
+            ret = -1;
+            break;
+        }
+
+        // a block runs on its own, like any other barrier
+        if (is_block_line(line)){
+            wait_all(slots, &num_busy);
+            int block = run_block(line, reader_source, reader, root);
+            if (block <= 0){
+                ret = block < 0 ? -1 : ret;
+                break;
+            }
+            continue;
+        }
+
+        LineTemplate *tmpl = parse_cache_get(line);
+        if (tmpl == (LineTemplate *) -1){
+            ret = -1;
+            break;
+        }
+
+        // assignments change what later lines expand to, and a $(...)
+        // could see what the lines in flight do
+        if (tmpl->assign_name != NULL || uses_status(tmpl)){
+            wait_all(slots, &num_busy);
+        }
+        Command *cmd = instantiate_line(tmpl, root, &arena);
+        if (cmd == (Command *) -1){
+            ret = -1;
+            break;
+        }
+        if (cmd == NULL){
+            arena_reset(&arena);
+            continue;
+        }
+
+        if (cmd->background || cmd->timed || has_builtin(cmd) || uses_status(tmpl)){
+            wait_all(slots, &num_busy);
+            int *result = execute_line(cmd);
+            arena_reset(&arena);
+            if (result == (int *) -1){
+                ret = -1;
+                break;
+            }
+            free(result);
+            if (exit_requested(NULL)){
+                break;
+            }
+            continue;
+        }
+
+        char **reads = collect_paths(cmd, 0);
+        char **writes = collect_paths(cmd, 1);
+        while (conflicts(slots, reads, writes) && wait_any(slots, &num_busy) == 0){}
+        while (num_busy == (size_t) max_jobs && wait_any(slots, &num_busy) == 0){}
+
+        jobs_reap();
+        size_t num_stages;
+        int known_status;
+        pid_t *pids = start_line(cmd, &num_stages, &known_status);
+        arena_reset(&arena);
+        if (pids == NULL){
+            free_paths(reads);
+            free_paths(writes);
+            ret = -1;
+            break;
+        }
+
+        size_t running = 0;
+        for (size_t i = 0; i < num_stages; i++){
+            running += pids[i] > 0;
+        }
+        lines_started++;
+        if (running == 0){
+            last_status = known_status < 0 ? 0 : known_status;
+            status_pending = 1;
+            free(pids);
+            free_paths(reads);
+            free_paths(writes);
+            continue;
+        }
+
+        Slot *slot = slots;
+        while (slot->pids != NULL){
+            slot++;
+        }
+        slot->pids = pids;
+        slot->num_pids = num_stages;
+        slot->num_running = running;
+        slot->seq = lines_started;
+        slot->status = known_status < 0 ? 0 : known_status;
+        slot->reads = reads;
+        slot->writes = writes;
+        num_busy++;
+    }
+
+    wait_all(slots, &num_busy);
+    free(slots);
+    arena_free(&arena);
+    return ret;
+}
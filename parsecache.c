@@ -0,0 +1,113 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+/*
+** An LRU cache of compiled lines, keyed by the raw line text. Because
+** variables are only filled in by instantiate_line, a LineTemplate
+** stays valid for as long as the text is the same, and a script that
+** runs the same line shape over and over only lexes it once.
+**
+** Entries are chained in PARSE_CACHE_BUCKETS hash buckets and threaded
+** on a recency list; each owns a small arena holding its key and
+** template, so eviction is a single arena_free.
+*/
+typedef struct CacheEntry {
+    char *key;
+    size_t hash;
+    LineTemplate *tmpl;
+    Arena arena;
+    struct CacheEntry *chain;
+    struct CacheEntry *prev;
+    struct CacheEntry *next;
+} CacheEntry;
+
+static CacheEntry *buckets[PARSE_CACHE_BUCKETS];
+static CacheEntry *lru_head = NULL;
+static CacheEntry *lru_tail = NULL;
+static size_t num_entries = 0;
+
+
+static void lru_unlink(CacheEntry *entry){
+    if (entry->prev) entry->prev->next = entry->next;
+    else lru_head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else lru_tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_push_front(CacheEntry *entry){
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head) lru_head->prev = entry;
+    lru_head = entry;
+    if (lru_tail == NULL) lru_tail = entry;
+}
+
+static void remove_entry(CacheEntry *entry){
+    CacheEntry **link = &buckets[entry->hash % PARSE_CACHE_BUCKETS];
+    while (*link != entry){
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+    lru_unlink(entry);
+    arena_free(&entry->arena);
+    free(entry);
+    num_entries--;
+}
+
+
+LineTemplate *parse_cache_get(const char *line){
+    size_t len = strlen(line);
+    size_t hash = hash_bytes(line, len);
+
+    for (CacheEntry *entry = buckets[hash % PARSE_CACHE_BUCKETS];
+         entry != NULL; entry = entry->chain){
+        if (entry->hash == hash && strcmp(entry->key, line) == 0){
+            if (entry != lru_head){
+                lru_unlink(entry);
+                lru_push_front(entry);
+            }
+            return entry->tmpl;
+        }
+    }
+
+    CacheEntry *entry = calloc(1, sizeof(CacheEntry));
+    if (entry == NULL){
+        perror("parse_cache_get");
+        return (LineTemplate *) -1;
+    }
+    entry->arena.block_size = PARSE_CACHE_BLOCK;
+    entry->key = arena_strndup(&entry->arena, line, len);
+    entry->hash = hash;
+    trace_begin("compile_line");
+    entry->tmpl = compile_line(entry->key, &entry->arena);
+    trace_end("compile_line");
+
+    // errors are reported every time, so they are not cached
+    if (entry->tmpl == (LineTemplate *) -1){
+        arena_free(&entry->arena);
+        free(entry);
+        return (LineTemplate *) -1;
+    }
+
+    if (num_entries == PARSE_CACHE_SIZE){
+        remove_entry(lru_tail);
+    }
+    entry->chain = buckets[hash % PARSE_CACHE_BUCKETS];
+    buckets[hash % PARSE_CACHE_BUCKETS] = entry;
+    lru_push_front(entry);
+    num_entries++;
+
+    return entry->tmpl;
+}
+
+
+void parse_cache_clear(){
+    while (lru_head != NULL){
+        remove_entry(lru_head);
+    }
+}
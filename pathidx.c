@@ -0,0 +1,481 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+#include <sys/mman.h>
+
+/*
+** Persistent PATH index (enabled with --path-index).
+**
+** The file is a snapshot of the names in every PATH directory, so a
+** fresh shell can answer "which directory holds ls" with a binary
+** search instead of a readdir scan. Layout, all integers native endian:
+**
+**   PathIdxHeader
+**   PathIdxDir     dirs[num_dirs]        -- identity of each directory
+**   PathIdxEntry   entries[num_entries]  -- sorted by (name, dir)
+**   char           strings[strings_len]  -- NUL terminated names/dirs
+**
+** A directory record is only trusted while its dev, inode and mtime
+** still match what stat() says. If any directory on the current PATH
+** is missing or stale the whole file is rebuilt (reusing the names of
+** directories that are still fresh) and atomically renamed into place.
+*/
+#define PATHIDX_MAGIC 0x58444950435343ULL   // "CSCPIDX\0"
+#define PATHIDX_VERSION 1
+
+typedef struct PathIdxHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t num_dirs;
+    uint32_t num_entries;
+    uint32_t strings_len;
+} PathIdxHeader;
+
+typedef struct PathIdxDir {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t path_off;
+    uint32_t pad;
+} PathIdxDir;
+
+typedef struct PathIdxEntry {
+    uint32_t name_off;
+    uint32_t dir;
+} PathIdxEntry;
+
+// an entry while building, before strings are laid out
+typedef struct BuildEntry {
+    char *name;
+    uint32_t dir;
+} BuildEntry;
+
+static char *idx_file = NULL;
+static void *idx_map = NULL;
+static size_t idx_map_len = 0;
+
+// the mapped sections
+static const PathIdxHeader *idx_header = NULL;
+static const PathIdxDir *idx_dirs = NULL;
+static const PathIdxEntry *idx_entries = NULL;
+static const char *idx_strings = NULL;
+
+// position on the current PATH of each index dir, or -1 if not on it
+static ssize_t *dir_positions = NULL;
+static uint8_t idx_usable = 0;
+
+
+static void unmap_index(){
+    if (idx_map != NULL){
+        munmap(idx_map, idx_map_len);
+    }
+    idx_map = NULL;
+    idx_map_len = 0;
+    idx_header = NULL;
+    idx_dirs = NULL;
+    idx_entries = NULL;
+    idx_strings = NULL;
+    idx_usable = 0;
+}
+
+// every offset points into the strings and every entry at a dir record
+static int offsets_valid(const PathIdxHeader *hdr){
+    const PathIdxDir *dirs = (const PathIdxDir *) (hdr + 1);
+    const PathIdxEntry *entries = (const PathIdxEntry *) (dirs + hdr->num_dirs);
+    for (uint32_t i = 0; i < hdr->num_dirs; i++){
+        if (dirs[i].path_off >= hdr->strings_len){
+            return 0;
+        }
+    }
+    for (uint32_t i = 0; i < hdr->num_entries; i++){
+        if (entries[i].name_off >= hdr->strings_len ||
+            entries[i].dir >= hdr->num_dirs){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+** Maps idx_file read-only and checks that it is well formed, down to
+** every offset in it, so that a truncated or corrupt file is rebuilt
+** instead of being read out of bounds.
+** Returns 0 if mapped, -1 if there is no (valid) index on disk.
+*/
+static int map_index(){
+    unmap_index();
+
+    int fd = open(idx_file, O_RDONLY);
+    if (fd < 0){
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(PathIdxHeader)){
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        return -1;
+    }
+
+    const PathIdxHeader *hdr = map;
+    size_t need = sizeof(PathIdxHeader) +
+        (size_t) hdr->num_dirs * sizeof(PathIdxDir) +
+        (size_t) hdr->num_entries * sizeof(PathIdxEntry) +
+        hdr->strings_len;
+    if (hdr->magic != PATHIDX_MAGIC || hdr->version != PATHIDX_VERSION ||
+        need != (size_t) st.st_size || hdr->strings_len == 0 ||
+        ((const char *) map)[st.st_size - 1] != '\0' || !offsets_valid(hdr)){
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    idx_map = map;
+    idx_map_len = st.st_size;
+    idx_header = hdr;
+    idx_dirs = (const PathIdxDir *) (hdr + 1);
+    idx_entries = (const PathIdxEntry *) (idx_dirs + hdr->num_dirs);
+    idx_strings = (const char *) (idx_entries + hdr->num_entries);
+    return 0;
+}
+
+static int same_identity(const PathIdxDir *rec, const struct stat *st){
+    return rec->dev == (uint64_t) st->st_dev &&
+        rec->ino == (uint64_t) st->st_ino &&
+        rec->mtime_sec == (int64_t) st->st_mtim.tv_sec &&
+        rec->mtime_nsec == (int64_t) st->st_mtim.tv_nsec;
+}
+
+// the fresh index record for dir, or -1
+static ssize_t find_fresh_dir(const char *dir, const struct stat *st){
+    if (idx_header == NULL){
+        return -1;
+    }
+    for (uint32_t i = 0; i < idx_header->num_dirs; i++){
+        if (strcmp(idx_strings + idx_dirs[i].path_off, dir) == 0 &&
+            same_identity(&idx_dirs[i], st)){
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int cmp_build_entry(const void *a, const void *b){
+    const BuildEntry *x = a, *y = b;
+    int c = strcmp(x->name, y->name);
+    if (c != 0){
+        return c;
+    }
+    return (x->dir > y->dir) - (x->dir < y->dir);
+}
+
+static int push_entry(BuildEntry **entries, size_t *count, size_t *cap,
+                      const char *name, uint32_t dir){
+    if (*count == *cap){
+        size_t new_cap = *cap ? *cap * 2 : 1024;
+        BuildEntry *tmp = realloc(*entries, new_cap * sizeof(BuildEntry));
+        if (tmp == NULL){
+            return -1;
+        }
+        *entries = tmp;
+        *cap = new_cap;
+    }
+    (*entries)[*count].name = strdup(name);
+    if ((*entries)[*count].name == NULL){
+        return -1;
+    }
+    (*entries)[(*count)++].dir = dir;
+    return 0;
+}
+
+// mkdir -p for the directory part of file
+static void make_parent_dirs(const char *file){
+    char *copy = strdup(file);
+    if (copy == NULL){
+        return;
+    }
+    for (char *p = copy + 1; *p; p++){
+        if (*p == '/'){
+            *p = '\0';
+            mkdir(copy, 0755);
+            *p = '/';
+        }
+    }
+    free(copy);
+}
+
+
+int write_file_atomic(const char *file, const void *buf, size_t len){
+    make_parent_dirs(file);
+    size_t tmp_len = strlen(file) + sizeof(".XXXXXX");
+    char *tmp_path = malloc(tmp_len);
+    if (tmp_path == NULL){
+        return -1;
+    }
+    snprintf(tmp_path, tmp_len, "%s.XXXXXX", file);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0){
+        free(tmp_path);
+        return -1;
+    }
+
+    size_t written = 0;
+    while (written < len){
+        ssize_t n = write(fd, (const char *) buf + written, len - written);
+        if (n < 0){
+            if (errno == EINTR) continue;
+            break;
+        }
+        written += n;
+    }
+    close(fd);
+
+    int ret = -1;
+    if (written == len && rename(tmp_path, file) == 0){
+        ret = 0;
+    }
+    else {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return ret;
+}
+
+/*
+** Writes a new index covering dirs (stats in sts; st_mode of 0 marks a
+** directory that could not be stat'd and is left out). Names of dirs
+** that are still fresh in the current mapping are copied from it, the
+** rest are read with readdir.
+**
+** Returns 0 on success, -1 on failure.
+*/
+static int rebuild_index(char **dirs, struct stat *sts, size_t num_dirs){
+    BuildEntry *entries = NULL;
+    size_t count = 0, cap = 0;
+    PathIdxDir *recs = calloc(num_dirs ? num_dirs : 1, sizeof(PathIdxDir));
+    uint32_t num_recs = 0;
+    size_t strings_len = 0;
+    char *buf = NULL;
+    int ret = -1;
+
+    if (recs == NULL){
+        return -1;
+    }
+
+    for (size_t i = 0; i < num_dirs; i++){
+        if (sts[i].st_mode == 0){
+            continue;
+        }
+        uint32_t rec = num_recs;
+        ssize_t old = find_fresh_dir(dirs[i], &sts[i]);
+
+        if (old >= 0){
+            for (uint32_t e = 0; e < idx_header->num_entries; e++){
+                if (idx_entries[e].dir == (uint32_t) old &&
+                    push_entry(&entries, &count, &cap,
+                               idx_strings + idx_entries[e].name_off, rec) < 0){
+                    goto rebuild_cleanup;
+                }
+            }
+        }
+        else {
+            // an unreadable dir is recorded empty so it doesn't force
+            // a rebuild on every start
+            DIR *dir = opendir(dirs[i]);
+            struct dirent *ent;
+            while (dir != NULL && (ent = readdir(dir)) != NULL){
+                if (strcmp(ent->d_name, ".") == 0 ||
+                    strcmp(ent->d_name, "..") == 0){
+                    continue;
+                }
+                if (push_entry(&entries, &count, &cap, ent->d_name, rec) < 0){
+                    closedir(dir);
+                    goto rebuild_cleanup;
+                }
+            }
+            if (dir != NULL){
+                closedir(dir);
+            }
+        }
+
+        recs[rec].dev = sts[i].st_dev;
+        recs[rec].ino = sts[i].st_ino;
+        recs[rec].mtime_sec = sts[i].st_mtim.tv_sec;
+        recs[rec].mtime_nsec = sts[i].st_mtim.tv_nsec;
+        recs[rec].path_off = strings_len;
+        strings_len += strlen(dirs[i]) + 1;
+        num_recs++;
+    }
+
+    qsort(entries, count, sizeof(BuildEntry), cmp_build_entry);
+    for (size_t e = 0; e < count; e++){
+        strings_len += strlen(entries[e].name) + 1;
+    }
+
+    size_t total = sizeof(PathIdxHeader) + num_recs * sizeof(PathIdxDir) +
+        count * sizeof(PathIdxEntry) + strings_len;
+    buf = calloc(1, total);
+    if (buf == NULL){
+        goto rebuild_cleanup;
+    }
+
+    PathIdxHeader *hdr = (PathIdxHeader *) buf;
+    hdr->magic = PATHIDX_MAGIC;
+    hdr->version = PATHIDX_VERSION;
+    hdr->num_dirs = num_recs;
+    hdr->num_entries = count;
+    hdr->strings_len = strings_len;
+
+    PathIdxDir *out_dirs = (PathIdxDir *) (hdr + 1);
+    PathIdxEntry *out_entries = (PathIdxEntry *) (out_dirs + num_recs);
+    char *out_strings = (char *) (out_entries + count);
+    memcpy(out_dirs, recs, num_recs * sizeof(PathIdxDir));
+
+    // dir paths first (their offsets were assigned above), then names
+    size_t off = 0;
+    for (size_t i = 0; i < num_dirs; i++){
+        if (sts[i].st_mode == 0){
+            continue;
+        }
+        strcpy(out_strings + off, dirs[i]);
+        off += strlen(dirs[i]) + 1;
+    }
+    for (size_t e = 0; e < count; e++){
+        out_entries[e].name_off = off;
+        out_entries[e].dir = entries[e].dir;
+        strcpy(out_strings + off, entries[e].name);
+        off += strlen(entries[e].name) + 1;
+    }
+
+    if (write_file_atomic(idx_file, buf, total) == 0){
+        ret = 0;
+    }
+
+rebuild_cleanup:
+    for (size_t e = 0; e < count; e++){
+        free(entries[e].name);
+    }
+    free(entries);
+    free(recs);
+    free(buf);
+    return ret;
+}
+
+
+int pathidx_open(const char *file){
+    pathidx_close();
+    idx_file = strdup(file);
+    if (idx_file == NULL){
+        perror("pathidx_open");
+        return -1;
+    }
+    // a missing or corrupt index is fine, the first sync builds it
+    map_index();
+    return 0;
+}
+
+
+int pathidx_enabled(){
+    return idx_file != NULL;
+}
+
+
+int pathidx_sync(char **dirs, size_t num_dirs){
+    if (idx_file == NULL){
+        return -1;
+    }
+    idx_usable = 0;
+
+    struct stat *sts = calloc(num_dirs ? num_dirs : 1, sizeof(struct stat));
+    ssize_t *positions = NULL;
+    if (sts == NULL){
+        return -1;
+    }
+
+    uint8_t stale = (idx_header == NULL);
+    for (size_t i = 0; i < num_dirs; i++){
+        if (stat(dirs[i], &sts[i]) < 0 || !S_ISDIR(sts[i].st_mode)){
+            memset(&sts[i], 0, sizeof(struct stat));
+            continue;
+        }
+        if (!stale && find_fresh_dir(dirs[i], &sts[i]) < 0){
+            stale = 1;
+        }
+    }
+
+    if (stale && (rebuild_index(dirs, sts, num_dirs) < 0 || map_index() < 0)){
+        free(sts);
+        return -1;
+    }
+
+    positions = malloc((idx_header->num_dirs ? idx_header->num_dirs : 1) *
+                       sizeof(ssize_t));
+    if (positions == NULL){
+        free(sts);
+        return -1;
+    }
+    for (uint32_t r = 0; r < idx_header->num_dirs; r++){
+        positions[r] = -1;
+    }
+    // first occurrence on PATH wins, as it would for a scan
+    for (size_t i = num_dirs; i-- > 0;){
+        if (sts[i].st_mode == 0){
+            continue;
+        }
+        ssize_t rec = find_fresh_dir(dirs[i], &sts[i]);
+        if (rec >= 0){
+            positions[rec] = i;
+        }
+    }
+
+    free(dir_positions);
+    dir_positions = positions;
+    free(sts);
+    idx_usable = 1;
+    return 0;
+}
+
+
+ssize_t pathidx_lookup(const char *command_name){
+    if (!idx_usable){
+        return -2;
+    }
+
+    // lower bound of command_name in the sorted entries
+    size_t lo = 0, hi = idx_header->num_entries;
+    while (lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(idx_strings + idx_entries[mid].name_off, command_name) < 0){
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    ssize_t best = -1;
+    for (size_t e = lo; e < idx_header->num_entries &&
+         strcmp(idx_strings + idx_entries[e].name_off, command_name) == 0; e++){
+        ssize_t pos = dir_positions[idx_entries[e].dir];
+        if (pos >= 0 && (best < 0 || pos < best)){
+            best = pos;
+        }
+    }
+    return best;
+}
+
+
+void pathidx_close(){
+    unmap_index();
+    free(dir_positions);
+    dir_positions = NULL;
+    free(idx_file);
+    idx_file = NULL;
+}
@@ -0,0 +1,253 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+/*
+** The interactive prompt. The PROMPT variable (DEFAULT_PROMPT if it is
+** not set) is compiled into a list of segments once, and again only when
+** its value changes. Escapes:
+**
+**     \u  user name        \h  host name (up to the first '.')
+**     \w  working dir      \W  last component of the working dir
+**     \?  status of the last line
+**     \T  how long the last line took
+**     \\  a backslash
+**
+** Each segment caches its text and is refreshed only by whatever can
+** change it: the user and host are looked up once, the working
+** directory after a cd (prompt_cwd_changed), the status and time after
+** each line (prompt_line_done). The rendered prompt goes out with a
+** single write.
+*/
+
+typedef enum PromptSegmentKind {
+    SEG_LITERAL,
+    SEG_USER,
+    SEG_HOST,
+    SEG_CWD,
+    SEG_CWD_BASE,
+    SEG_STATUS,
+    SEG_ELAPSED
+} PromptSegmentKind;
+
+typedef struct PromptSegment {
+    PromptSegmentKind kind;
+    const char *text;
+    size_t len;
+} PromptSegment;
+
+// the compiled template and the source it came from
+static char *source = NULL;
+static char *literals = NULL;
+static PromptSegment *segments = NULL;
+static size_t num_segments = 0;
+
+// cached segment text; an empty string means not looked up yet
+static char user[MAX_USER_BUF];
+static char host[MAX_USER_BUF];
+static char cwd[MAX_PATH_STR];
+static int cwd_valid = 0;
+static int last_status = 0;
+static long last_elapsed_us = 0;
+
+// output buffer, reused for every prompt
+static char *out = NULL;
+static size_t out_cap = 0;
+
+
+static int compile_prompt(const char *template){
+    size_t len = strlen(template);
+    char *new_source = strdup(template);
+    char *new_literals = malloc(len + 1);
+    PromptSegment *new_segments = malloc((len + 1) * sizeof(PromptSegment));
+    if (new_source == NULL || new_literals == NULL || new_segments == NULL){
+        perror("prompt");
+        free(new_source);
+        free(new_literals);
+        free(new_segments);
+        return -1;
+    }
+
+    size_t n = 0;
+    char *lit = new_literals;
+    char *lit_start = lit;
+    for (const char *p = template; *p; p++){
+        PromptSegmentKind kind = SEG_LITERAL;
+        if (*p == '\\' && p[1] != '\0'){
+            switch (p[1]){
+            case 'u': kind = SEG_USER; break;
+            case 'h': kind = SEG_HOST; break;
+            case 'w': kind = SEG_CWD; break;
+            case 'W': kind = SEG_CWD_BASE; break;
+            case '?': kind = SEG_STATUS; break;
+            case 'T': kind = SEG_ELAPSED; break;
+            case '\\': p++; break;
+            default: break;
+            }
+        }
+        if (kind == SEG_LITERAL){
+            *lit++ = *p;
+            continue;
+        }
+
+        if (lit > lit_start){
+            new_segments[n++] = (PromptSegment){SEG_LITERAL, lit_start, lit - lit_start};
+            lit_start = lit;
+        }
+        new_segments[n++] = (PromptSegment){kind, NULL, 0};
+        p++;
+    }
+    if (lit > lit_start){
+        new_segments[n++] = (PromptSegment){SEG_LITERAL, lit_start, lit - lit_start};
+    }
+
+    free(source);
+    free(literals);
+    free(segments);
+    source = new_source;
+    literals = new_literals;
+    segments = new_segments;
+    num_segments = n;
+    return 0;
+}
+
+static const char *user_name(){
+    if (user[0] == '\0'){
+        struct passwd *pw = getpwuid(geteuid());
+        if (pw != NULL){
+            snprintf(user, sizeof(user), "%s", pw->pw_name);
+        }
+        else if (getlogin_r(user, sizeof(user)) != 0){
+            snprintf(user, sizeof(user), "?");
+        }
+    }
+    return user;
+}
+
+static const char *host_name(){
+    if (host[0] == '\0'){
+        if (gethostname(host, sizeof(host) - 1) != 0){
+            snprintf(host, sizeof(host), "?");
+        }
+        host[strcspn(host, ".")] = '\0';
+    }
+    return host;
+}
+
+static const char *working_dir(){
+    if (!cwd_valid){
+        if (getcwd(cwd, sizeof(cwd)) == NULL){
+            snprintf(cwd, sizeof(cwd), "?");
+        }
+        cwd_valid = 1;
+    }
+    return cwd;
+}
+
+static void append(size_t *len, const char *text, size_t text_len){
+    if (*len + text_len > out_cap){
+        size_t new_cap = out_cap ? out_cap : 256;
+        while (new_cap < *len + text_len){
+            new_cap *= 2;
+        }
+        char *grown = realloc(out, new_cap);
+        if (grown == NULL){
+            return;
+        }
+        out = grown;
+        out_cap = new_cap;
+    }
+    memcpy(out + *len, text, text_len);
+    *len += text_len;
+}
+
+
+void prompt_cwd_changed(){
+    cwd_valid = 0;
+}
+
+void prompt_line_done(int status, long elapsed_us){
+    last_status = status;
+    last_elapsed_us = elapsed_us;
+}
+
+int prompt_write(VarTable *variables){
+    Variable *var = vars_get(variables, PROMPT_VAR_NAME);
+    const char *template = var ? var->value : DEFAULT_PROMPT;
+    if ((source == NULL || strcmp(source, template) != 0) &&
+        compile_prompt(template) < 0){
+        return -1;
+    }
+
+    size_t len = 0;
+    char number[32];
+    for (size_t i = 0; i < num_segments; i++){
+        const PromptSegment *seg = &segments[i];
+        const char *text = seg->text;
+        size_t text_len = seg->len;
+
+        switch (seg->kind){
+        case SEG_LITERAL:
+            break;
+        case SEG_USER:
+            text = user_name();
+            break;
+        case SEG_HOST:
+            text = host_name();
+            break;
+        case SEG_CWD:
+            text = working_dir();
+            break;
+        case SEG_CWD_BASE:
+            text = working_dir();
+            if (strrchr(text, '/') != NULL && text[1] != '\0'){
+                text = strrchr(text, '/') + 1;
+            }
+            break;
+        case SEG_STATUS:
+            snprintf(number, sizeof(number), "%d", last_status);
+            text = number;
+            break;
+        case SEG_ELAPSED:
+            if (last_elapsed_us < 1000000){
+                snprintf(number, sizeof(number), "%ldms", last_elapsed_us / 1000);
+            }
+            else {
+                snprintf(number, sizeof(number), "%ld.%03lds",
+                         last_elapsed_us / 1000000, last_elapsed_us / 1000 % 1000);
+            }
+            text = number;
+            break;
+        }
+        if (seg->kind != SEG_LITERAL){
+            text_len = strlen(text);
+        }
+        append(&len, text, text_len);
+    }
+
+    // anything still buffered in stdout belongs before the prompt
+    fflush(stdout);
+    for (size_t off = 0; off < len;){
+        ssize_t n = write(STDOUT_FILENO, out + off, len - off);
+        if (n < 0){
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+void prompt_free(){
+    free(source);
+    free(literals);
+    free(segments);
+    free(out);
+    source = literals = out = NULL;
+    segments = NULL;
+    num_segments = 0;
+    out_cap = 0;
+}
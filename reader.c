@@ -0,0 +1,237 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <sys/mman.h>
+
+/*
+** Reads a script one logical line at a time. A regular file is mapped
+** and each line is copied out of the mapping into one reusable buffer;
+** pipes and stdin are read into one reusable buffer that grows to fit
+** the longest line. Either way there is no limit on line length.
+**
+** A line ending in an odd number of unquoted backslashes continues on
+** the next line, and the backslash-newline pair is dropped. The search
+** for the end of a line follows quotes and comments the way the lexer
+** does, so a backslash inside quotes or a comment ends nothing.
+*/
+
+static const LineScan line_start = {0, 0, 0, 1};
+
+// finds the newline that ends the logical line, searching from from up
+// to end and carrying on from *state; NULL if it needs more input
+static char *logical_line_end(char *from, char *end, LineScan *state){
+    for (char *p = from; p < end; p++){
+        char c = *p;
+        if (state->escaped){
+            // only an unquoted backslash joins lines
+            if (c == '\n' && state->escaped == 2){
+                *state = line_start;
+                return p;
+            }
+            state->escaped = 0;
+            state->word_start = 0;
+            continue;
+        }
+        if (c == '\n'){
+            *state = line_start;
+            return p;
+        }
+        if (state->comment){
+            continue;
+        }
+        if (state->quote == '\''){
+            state->quote = c == '\'' ? 0 : state->quote;
+        }
+        else if (state->quote == '"'){
+            if (c == '\\'){
+                state->escaped = 2;
+            }
+            state->quote = c == '"' ? 0 : state->quote;
+        }
+        else if (c == '\\'){
+            state->escaped = 1;
+        }
+        else if (c == '\'' || c == '"'){
+            state->quote = c;
+        }
+        else if (c == '#' && state->word_start){
+            state->comment = 1;
+        }
+        state->word_start = !state->quote && (isspace((unsigned char) c) ||
+            c == '|' || c == '<' || c == '>' || c == '&');
+    }
+    return NULL;
+}
+
+// copies [start, end) to dst without its backslash-newline pairs, which
+// are the only newlines in a logical line, and NUL terminates it
+static char *join_line(char *dst, const char *start, const char *end){
+    char *out = dst;
+    for (const char *src = start; src < end; src++){
+        if (*src == '\\' && src + 1 < end && src[1] == '\n'){
+            src++;
+            continue;
+        }
+        *out++ = *src;
+    }
+    *out = '\0';
+    return dst;
+}
+
+// makes buf hold at least size bytes
+static int reserve_buf(ScriptReader *reader, size_t size){
+    if (size <= reader->cap){
+        return 0;
+    }
+    size_t new_cap = reader->cap ? reader->cap : READER_BUF_SIZE;
+    while (new_cap < size){
+        new_cap *= 2;
+    }
+    char *grown = realloc(reader->buf, new_cap);
+    if (grown == NULL){
+        perror("run_script");
+        return -1;
+    }
+    reader->buf = grown;
+    reader->cap = new_cap;
+    return 0;
+}
+
+// reads more of a streamed script, keeping the unread part of the
+// buffer; returns bytes read, 0 at end of input, -1 on error
+static ssize_t refill(ScriptReader *reader){
+    if (reader->pos > 0){
+        memmove(reader->buf, reader->buf + reader->pos, reader->len - reader->pos);
+        reader->len -= reader->pos;
+        reader->scan -= reader->pos;
+        reader->pos = 0;
+    }
+    // always leave a byte spare for the NUL of an unterminated last line
+    if (reader->cap - reader->len < 2){
+        size_t new_cap = reader->cap ? reader->cap * 2 : READER_BUF_SIZE;
+        char *grown = realloc(reader->buf, new_cap);
+        if (grown == NULL){
+            perror("run_script");
+            return -1;
+        }
+        reader->buf = grown;
+        reader->cap = new_cap;
+    }
+
+    ssize_t n;
+    do {
+        n = read(reader->fd, reader->buf + reader->len, reader->cap - reader->len - 1);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0){
+        perror("run_script");
+        return -1;
+    }
+    reader->len += n;
+    return n;
+}
+
+
+int reader_open(ScriptReader *reader, const char *path){
+    memset(reader, 0, sizeof(ScriptReader));
+    reader->scan_state = line_start;
+    if (strcmp(path, "-") == 0){
+        reader->fd = STDIN_FILENO;
+        return 0;
+    }
+
+    reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (reader->fd < 0){
+        return -1;
+    }
+    reader->owns_fd = 1;
+
+    if (fstat(reader->fd, &reader->st) == 0 && S_ISREG(reader->st.st_mode) &&
+        reader->st.st_size > 0){
+        char *map = mmap(NULL, reader->st.st_size, PROT_READ, MAP_PRIVATE,
+                         reader->fd, 0);
+        if (map != MAP_FAILED){
+            madvise(map, reader->st.st_size, MADV_SEQUENTIAL);
+            reader->map = map;
+            reader->len = reader->st.st_size;
+        }
+    }
+    return 0;
+}
+
+
+static char *next_line(ScriptReader *reader){
+    if (reader->map != NULL){
+        if (reader->pos >= reader->len){
+            return NULL;
+        }
+        char *start = reader->map + reader->pos;
+        char *end = reader->map + reader->len;
+        LineScan state = line_start;
+        char *line_end = logical_line_end(start, end, &state);
+        if (line_end == NULL){
+            // the last line has no newline
+            line_end = end;
+        }
+        reader->pos = line_end + 1 - reader->map;
+        if (reserve_buf(reader, line_end - start + 1) < 0){
+            return (char *) -1;
+        }
+        return join_line(reader->buf, start, line_end);
+    }
+
+    for (;;){
+        char *start = reader->buf + reader->pos;
+        char *end = reader->buf + reader->len;
+        char *line_end = logical_line_end(reader->buf + reader->scan, end,
+                                          &reader->scan_state);
+        if (line_end != NULL){
+            reader->pos = reader->scan = line_end + 1 - reader->buf;
+            return join_line(start, start, line_end);
+        }
+        // everything buffered has been searched, so only new input needs
+        // to be looked at next time
+        reader->scan = reader->len;
+
+        if (reader->eof){
+            if (start == end){
+                return NULL;
+            }
+            reader->pos = reader->scan = reader->len;
+            reader->scan_state = line_start;
+            return join_line(start, start, end);
+        }
+        ssize_t n = refill(reader);
+        if (n < 0){
+            return (char *) -1;
+        }
+        if (n == 0){
+            reader->eof = 1;
+        }
+    }
+}
+
+char *reader_next(ScriptReader *reader){
+    trace_begin("read_line");
+    char *line = next_line(reader);
+    trace_end("read_line");
+    return line;
+}
+
+char *reader_source(void *reader){
+    return reader_next(reader);
+}
+
+
+void reader_close(ScriptReader *reader){
+    if (reader->map != NULL){
+        munmap(reader->map, reader->st.st_size);
+    }
+    free(reader->buf);
+    if (reader->owns_fd){
+        close(reader->fd);
+    }
+    memset(reader, 0, sizeof(ScriptReader));
+}
@@ -5,6 +5,10 @@
 
 #include "cscshell.h"
 
+#include <spawn.h>
+#include <signal.h>
+#include <sys/resource.h>
+
 
 // COMPLETE
 int cd_cscshell(const char *target_dir){
@@ -29,85 +33,838 @@ int cd_cscshell(const char *target_dir){
     return 0;
 }
 
-int *execute_line(Command *head){
-    
-    // handle empty command, nothing to execute
-    if (!head) {
-        return NULL;
+// how run_command starts children, see set_launch_mode
+static LaunchMode launch_mode = DEFAULT_LAUNCH;
+
+// bytes requested for each pipeline pipe, 0 keeps the kernel default
+static int pipe_size = 0;
+
+void set_pipe_size(int bytes){
+    pipe_size = bytes;
+}
+
+// convert a wait status to the shell's notion of an exit code
+int status_to_exit_code(int status){
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
     }
+    return status;
+}
 
-    // initialize and allocate return status
-    int *return_status = malloc(sizeof(int));
-    
-    // error checking
-    if (!return_status) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+/*
+** Builtins run in the shell process instead of being forked. Each gets
+** its stage's argv and the fds its input comes from and its output
+** should go to (a pipe, a redirected file or stdin/stdout) and returns
+** the stage's exit status; they use the fds directly, so the shell's
+** own stdin and stdout are never moved. reads_input marks the ones
+** that read in_fd, and changes_shell the ones whose effect outlives
+** the line (a command substitution runs those in a child).
+*/
+typedef int (*BuiltinFn)(char **args, int in_fd, int out_fd);
+
+typedef struct Builtin {
+    const char *name;
+    BuiltinFn fn;
+    uint8_t reads_input;
+    uint8_t changes_shell;
+} Builtin;
+
+// the variables export, unset and type work on, see set_builtin_variables
+static VarTable *shell_variables = NULL;
+
+// set once exit has run, see exit_requested
+static int exit_pending = 0;
+static int exit_status = 0;
+
+void set_builtin_variables(VarTable *variables){
+    shell_variables = variables;
+}
+
+// keeps $? and $! up to date
+void set_status_variable(const char *name, long value){
+    if (shell_variables == NULL) {
+        return;
+    }
+    char text[3 * sizeof(long) + 2];
+    snprintf(text, sizeof(text), "%ld", value);
+    vars_set(shell_variables, name, text);
+}
+
+int exit_requested(int *status){
+    if (exit_pending && status != NULL) {
+        *status = exit_status;
+    }
+    return exit_pending;
+}
+
+// writes a builtin's output, returning the status the builtin should
+// exit with; a reader that went away is silent, as SIGPIPE would be
+static int builtin_write(const char *name, int fd, const char *buf, size_t len){
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EPIPE) {
+                return 128 + SIGPIPE;
+            }
+            perror(name);
+            return 1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int builtin_cd(char **args, int in_fd, int out_fd){
+    (void) in_fd;
+    (void) out_fd;
+    if (cd_cscshell(args[1]) < 0) {
+        return 1;
+    }
+    prompt_cwd_changed();
+    zygote_cwd_changed();
+    return 0;
+}
+
+static int builtin_echo(char **args, int in_fd, int out_fd){
+    (void) in_fd;
+    int newline = 1;
+    size_t first = 1;
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+        newline = 0;
+        first = 2;
+    }
+
+    // one write for the whole line
+    size_t len = 0;
+    for (size_t i = first; args[i] != NULL; i++) {
+        len += strlen(args[i]) + 1;
+    }
+    char *buf = malloc(len + 1);
+    if (buf == NULL) {
+        perror("echo");
+        return 1;
+    }
+    size_t off = 0;
+    for (size_t i = first; args[i] != NULL; i++) {
+        if (i > first) {
+            buf[off++] = ' ';
+        }
+        size_t arg_len = strlen(args[i]);
+        memcpy(buf + off, args[i], arg_len);
+        off += arg_len;
+    }
+    if (newline) {
+        buf[off++] = '\n';
+    }
+
+    int ret = builtin_write("echo", out_fd, buf, off);
+    free(buf);
+    return ret;
+}
+
+static int builtin_pwd(char **args, int in_fd, int out_fd){
+    (void) in_fd;
+    (void) args;
+    char cwd[MAX_PATH_STR];
+    if (getcwd(cwd, sizeof(cwd) - 1) == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    size_t len = strlen(cwd);
+    cwd[len++] = '\n';
+    return builtin_write("pwd", out_fd, cwd, len);
+}
+
+// export NAME[=VALUE]...: puts shell variables into the environment of
+// the commands the shell starts
+static int builtin_export(char **args, int in_fd, int out_fd){
+    (void) in_fd;
+    (void) out_fd;
+    int ret = 0;
+    for (size_t i = 1; args[i] != NULL; i++) {
+        char *equals = strchr(args[i], '=');
+        if (equals != NULL) {
+            *equals = '\0';
+        }
+        if (!is_valid_variable_name(args[i])) {
+            ERR_PRINT(ERR_VAR_NAME, args[i]);
+            ret = 1;
+            continue;
+        }
+        if (equals != NULL && vars_set(shell_variables, args[i], equals + 1) < 0) {
+            return 1;
+        }
+        Variable *var = vars_get(shell_variables, args[i]);
+        if (var != NULL && setenv(var->name, var->value, 1) < 0) {
+            perror("export");
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+static int builtin_unset(char **args, int in_fd, int out_fd){
+    (void) in_fd;
+    (void) out_fd;
+    for (size_t i = 1; args[i] != NULL; i++) {
+        vars_unset(shell_variables, args[i]);
+        unsetenv(args[i]);
     }
+    return 0;
+}
 
-    *return_status = 0;
+static int builtin_type(char **args, int in_fd, int out_fd){
+    (void) in_fd;
+    int ret = 0;
+    for (size_t i = 1; args[i] != NULL; i++) {
+        if (is_builtin(args[i])) {
+            dprintf(out_fd, "%s is a shell builtin\n", args[i]);
+            continue;
+        }
+        char *path = hash_resolve(args[i], shell_variables ? shell_variables->path : NULL);
+        if (path == NULL) {
+            fprintf(stderr, "type: %s: not found\n", args[i]);
+            ret = 1;
+            continue;
+        }
+        dprintf(out_fd, "%s is %s\n", args[i], path);
+        free(path);
+    }
+    return ret;
+}
 
-    // create pipe, track the output end of the last pipe
-    int pipe_fds[2];
-    // int last_output_fd = -1;
+static int builtin_true(char **args, int in_fd, int out_fd){
+    (void) in_fd;
+    (void) args;
+    (void) out_fd;
+    return 0;
+}
 
+static int builtin_false(char **args, int in_fd, int out_fd){
+    (void) in_fd;
+    (void) args;
+    (void) out_fd;
+    return 1;
+}
+
+// exit [N]: the script or prompt loop stops once the line is done
+static int builtin_exit(char **args, int in_fd, int out_fd){
+    (void) in_fd;
+    (void) out_fd;
+    int status = args[1] != NULL ? atoi(args[1]) & 0xff : 0;
+    exit_pending = 1;
+    exit_status = status;
+    return status;
+}
+
+static const Builtin builtins[] = {
+    {CD, builtin_cd, 0, 1},
+    {HASH, hash_builtin, 0, 1},
+    {"echo", builtin_echo, 0, 0},
+    {"pwd", builtin_pwd, 0, 0},
+    {"export", builtin_export, 0, 1},
+    {"unset", builtin_unset, 0, 1},
+    {"type", builtin_type, 0, 0},
+    {"true", builtin_true, 0, 0},
+    {"false", builtin_false, 0, 0},
+    {"exit", builtin_exit, 0, 1},
+    {"jobs", jobs_builtin, 0, 0},
+    {"wait", wait_builtin, 0, 1},
+    {"par", par_builtin, 1, 0},
+    {"cat", cat_builtin, 1, 0},
+    {"tee", tee_builtin, 1, 0},
+    {"test", test_builtin, 0, 0},
+    {"[", test_builtin, 0, 0},
+};
+
+static const Builtin *find_builtin(const char *name){
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+int is_builtin(const char *name){
+    return find_builtin(name) != NULL;
+}
+
+static int builtin_reads_input(const char *name){
+    const Builtin *builtin = find_builtin(name);
+    return builtin != NULL && builtin->reads_input;
+}
+
+int builtin_changes_shell(const char *name){
+    const Builtin *builtin = find_builtin(name);
+    return builtin != NULL && builtin->changes_shell;
+}
+
+VarTable *builtin_variables(){
+    return shell_variables;
+}
+
+/*
+** Runs a builtin stage in the shell process and returns its status.
+** Redirections are opened like a child would open them. SIGPIPE is held
+** off while the builtin writes, so a reader that already went away
+** costs the builtin an EPIPE rather than killing the shell.
+*/
+static int run_builtin(Command *command){
+    const Builtin *builtin = find_builtin(command->exec_path);
+    int in_fd = command->stdin_fd;
+    int out_fd = command->stdout_fd;
+    int status;
+
+    if (command->redir_in_path != NULL) {
+        in_fd = open(command->redir_in_path, O_RDONLY | O_CLOEXEC);
+        if (in_fd == -1) {
+            perror("open");
+            return 1;
+        }
+    }
+    if (command->redir_out_path != NULL) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC |
+            (command->redir_append ? O_APPEND : O_TRUNC);
+        out_fd = open(command->redir_out_path, flags, 0644);
+        if (out_fd == -1) {
+            perror("open");
+            if (in_fd != (int) command->stdin_fd) {
+                close(in_fd);
+            }
+            return 1;
+        }
+    }
+
+    sigset_t pipe_set, old_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_set, &old_set);
+
+    // whatever the shell printed so far comes first
+    fflush(stdout);
+    trace_begin(builtin->name);
+    status = builtin->fn(command->args, in_fd, out_fd);
+    trace_end(builtin->name);
+
+    struct timespec no_wait = {0, 0};
+    while (sigtimedwait(&pipe_set, NULL, &no_wait) == SIGPIPE) {}
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+
+    if (in_fd != (int) command->stdin_fd) {
+        close(in_fd);
+    }
+    if (out_fd != (int) command->stdout_fd) {
+        close(out_fd);
+    }
+    return status;
+}
+
+/*
+** A builtin feeding one that reads its input cannot wait its turn in
+** the shell (the reader would wait for it forever), so it gets a child
+** of its own, like every stage of a pipeline in sh. So does a builtin on
+** a background line, which then has a pid to be a job with.
+*/
+static pid_t fork_builtin(Command *command){
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        return -1;
+    }
+    if (pid == 0) {
+        trace_forked();
+        // the zygote's children would be the shell's, not this copy's
+        zygote_forked();
+        if (launch_mode == LAUNCH_ZYGOTE) {
+            launch_mode = LAUNCH_SPAWN;
+        }
+        // nothing execs to drop the next stage's end of the output pipe,
+        // and holding it would keep the builtin writing once that stage
+        // has exited
+        if (command->next != NULL && command->next->stdin_fd != STDIN_FILENO) {
+            close(command->next->stdin_fd);
+        }
+        int status = run_builtin(command);
+        fflush(stdout);
+        _exit(status);
+    }
+    trace_child_started(pid, command->args[0]);
+    return pid;
+}
+
+// the parent's copies of a stage's pipe ends
+static void close_stage_fds(Command *command){
+    if (command->stdin_fd != STDIN_FILENO) {
+        close(command->stdin_fd);
+        command->stdin_fd = STDIN_FILENO;
+    }
+    if (command->stdout_fd != STDOUT_FILENO) {
+        close(command->stdout_fd);
+        command->stdout_fd = STDOUT_FILENO;
+    }
+}
+
+pid_t *start_line(Command *head, size_t *num_stages, int *status){
+
+    size_t num_cmds = 0;
+    for (Command *cmd = head; cmd != NULL; cmd = cmd->next) {
+        num_cmds++;
+    }
+    *num_stages = num_cmds;
+    *status = -1;
+
+    // pid of each stage, 0 for builtins
+    pid_t *pids = calloc(num_cmds, sizeof(pid_t));
+    Command **stages = malloc(num_cmds * sizeof(Command *));
+    if (!pids || !stages) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t i = 0;
+    for (Command *cmd = head; cmd != NULL; cmd = cmd->next) {
+        stages[i++] = cmd;
+    }
+
+    int launch_failed = 0;
     Command *current_cmd = head;
+    i = 0;
+
+    // launch every stage before waiting on any of them, so that data
+    // flows through the pipes while all stages are running
+    for (; current_cmd != NULL; current_cmd = current_cmd->next, i++) {
 
-    while (current_cmd != NULL) {
-        // set up piping if next command exists
+        // set up piping if next command exists; close-on-exec so that
+        // children only keep the ends they dup onto stdin/stdout
         if (current_cmd->next) {
-            
-            // error checking
-            if (pipe(pipe_fds) == -1) {
+            int pipe_fds[2];
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
                 perror("pipe");
-                exit(EXIT_FAILURE);
+                launch_failed = 1;
+                break;
+            }
+            if (pipe_size > 0 &&
+                fcntl(pipe_fds[1], F_SETPIPE_SZ, pipe_size) == -1) {
+                perror("fcntl F_SETPIPE_SZ");
             }
 
-            current_cmd->stdout_fd = pipe_fds[1]; 
+            current_cmd->stdout_fd = pipe_fds[1];
             current_cmd->next->stdin_fd = pipe_fds[0];
         }
 
-        // use cd_cscshell if current_cmd is cd
-        if(strcmp(current_cmd->exec_path, "cd") == 0) {
-            *return_status = cd_cscshell(current_cmd->args[1]);
+        // builtins run once everything else has started, see below;
+        // one with a reading builtin anywhere to its right is forked, and
+        // so is every one on a background line, which must not hold the
+        // shell up
+        int feeds_reader = 0;
+        for (Command *later = current_cmd->next; later != NULL; later = later->next) {
+            feeds_reader |= builtin_reads_input(later->exec_path);
+        }
+        if (is_builtin(current_cmd->exec_path) && !feeds_reader && !head->background) {
+            continue;
         }
 
-        // else run current_cmd
-        else {
-            int pid = run_command(current_cmd);
-            waitpid(pid, return_status, 0);
+        pids[i] = is_builtin(current_cmd->exec_path) ?
+            fork_builtin(current_cmd) : run_command(current_cmd);
+        if (pids[i] == -1) {
+            pids[i] = 0;
+            launch_failed = 1;
+        }
+        // started nothing, but the line goes on as if it exited 1
+        else if (pids[i] == 0 && current_cmd->next == NULL) {
+            *status = EXIT_FAILURE;
         }
 
-        // close pipe's write end
-        if (current_cmd->next) {
-            close(pipe_fds[1]); 
+        // the parent needs neither end once the stage owns them
+        close_stage_fds(current_cmd);
+
+        if (launch_failed) {
+            break;
         }
+    }
 
-        current_cmd = current_cmd->next;  
+    // a failed launch leaves the read end of the next pipe open
+    if (launch_failed && current_cmd != NULL && current_cmd->next != NULL &&
+        current_cmd->next->stdin_fd != STDIN_FILENO) {
+        close(current_cmd->next->stdin_fd);
+        current_cmd->next->stdin_fd = STDIN_FILENO;
     }
 
-    return return_status;
+    /*
+    ** Builtin stages still hold their pipe ends. They run right to left:
+    ** anything they write into a pipe then has a reader that is already
+    ** running (or has closed its end, which only costs an EPIPE), and
+    ** whatever is upstream of a builtin that reads its input was
+    ** forked above, so nothing can wait on a builtin further left. If
+    ** the line failed they are not run at all.
+    */
+    for (size_t j = num_cmds; j-- > 0;) {
+        Command *cmd = stages[j];
+        if (!is_builtin(cmd->exec_path) || pids[j] != 0) {
+            continue;
+        }
+        if (!launch_failed) {
+            int builtin_status = run_builtin(cmd);
+            if (j == num_cmds - 1) {
+                *status = builtin_status;
+            }
+        }
+        close_stage_fds(cmd);
+    }
+    free(stages);
+
+    // whatever did start is collected before reporting the failure
+    if (launch_failed) {
+        for (size_t j = 0; j < num_cmds; j++) {
+            if (pids[j] > 0) {
+                int wstatus = 0;
+                while (waitpid(pids[j], &wstatus, 0) == -1 && errno == EINTR) {}
+                trace_child_exited(pids[j], wstatus);
+            }
+        }
+        free(pids);
+        return NULL;
+    }
+    return pids;
+}
+
+
+// CSCSHELL_TIMING=1: every line is timed, see set_line_timing
+static int time_every_line = 0;
+
+void set_line_timing(int on){
+    time_every_line = on;
+}
+
+// what a timed line has used before its stages are waited for
+typedef struct LineTimer {
+    struct timespec start;
+    struct rusage self_before;
+    long launch_us;
+} LineTimer;
+
+static long elapsed_us(const struct timespec *start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L +
+        (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static long timeval_us(const struct timeval *tv){
+    return tv->tv_sec * 1000000L + tv->tv_usec;
+}
+
+static int format_seconds(char *buf, size_t size, long us){
+    return snprintf(buf, size, "%ld.%03lds", us / 1000000, us / 1000 % 1000);
+}
+
+static size_t timing_row(char *out, const char *name, long wall_us,
+                         long user_us, long sys_us, long maxrss_kb,
+                         long vcsw, long ivcsw){
+    char wall[32], user[32], sys[32];
+    format_seconds(wall, sizeof(wall), wall_us);
+    format_seconds(user, sizeof(user), user_us);
+    format_seconds(sys, sizeof(sys), sys_us);
+    return sprintf(out, "%-12.12s %10s %10s %10s %10ldKB %8ld %8ld\n",
+                   name, wall, user, sys, maxrss_kb, vcsw, ivcsw);
+}
+
+/*
+** Waits for the stages of a timed line with wait4, in whatever order
+** they exit so that each stage's wall time is its own, then reports one
+** row per child stage, one for the shell itself (launching the line and
+** running its builtins) and the total, in a single write to stderr.
+** Children that are not stages of the line belong to background jobs.
+** Returns the line's status.
+*/
+static int wait_timed(Command *head, pid_t *pids, size_t num_stages,
+                      const LineTimer *timer, int status){
+    struct rusage *usage = calloc(num_stages, sizeof(struct rusage));
+    long *wall_us = calloc(num_stages, sizeof(long));
+    uint8_t *done = calloc(num_stages, sizeof(uint8_t));
+    char *report = malloc((num_stages + 3) * 128);
+    if (!usage || !wall_us || !done || !report) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t left = 0;
+    for (size_t j = 0; j < num_stages; j++) {
+        left += pids[j] > 0;
+    }
+    while (left > 0) {
+        int wstatus;
+        struct rusage ru;
+        trace_begin("wait4");
+        pid_t pid = wait4(-1, &wstatus, 0, &ru);
+        trace_end("wait4");
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wait4");
+            break;
+        }
+        size_t j = 0;
+        while (j < num_stages && (pids[j] != pid || done[j])) {
+            j++;
+        }
+        if (j == num_stages) {
+            jobs_child_exited(pid, wstatus);
+            continue;
+        }
+        trace_child_exited(pid, wstatus);
+        usage[j] = ru;
+        wall_us[j] = elapsed_us(&timer->start);
+        done[j] = 1;
+        left--;
+        if (j == num_stages - 1) {
+            status = status_to_exit_code(wstatus);
+        }
+    }
+
+    struct rusage self;
+    getrusage(RUSAGE_SELF, &self);
+    long self_user = timeval_us(&self.ru_utime) - timeval_us(&timer->self_before.ru_utime);
+    long self_sys = timeval_us(&self.ru_stime) - timeval_us(&timer->self_before.ru_stime);
+    long self_vcsw = self.ru_nvcsw - timer->self_before.ru_nvcsw;
+    long self_ivcsw = self.ru_nivcsw - timer->self_before.ru_nivcsw;
+
+    size_t len = sprintf(report, "%-12s %10s %10s %10s %12s %8s %8s\n",
+                         "stage", "real", "user", "sys", "maxrss", "vcsw", "ivcsw");
+    long user_us = self_user, sys_us = self_sys;
+    long maxrss = self.ru_maxrss, vcsw = self_vcsw, ivcsw = self_ivcsw;
+    size_t j = 0;
+    for (Command *cmd = head; cmd != NULL && j < num_stages; cmd = cmd->next, j++) {
+        if (!done[j]) {
+            continue;
+        }
+        struct rusage *ru = &usage[j];
+        len += timing_row(report + len, cmd->args[0], wall_us[j],
+                          timeval_us(&ru->ru_utime), timeval_us(&ru->ru_stime),
+                          ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+        user_us += timeval_us(&ru->ru_utime);
+        sys_us += timeval_us(&ru->ru_stime);
+        maxrss = ru->ru_maxrss > maxrss ? ru->ru_maxrss : maxrss;
+        vcsw += ru->ru_nvcsw;
+        ivcsw += ru->ru_nivcsw;
+    }
+    len += timing_row(report + len, "(shell)", timer->launch_us, self_user,
+                      self_sys, self.ru_maxrss, self_vcsw, self_ivcsw);
+    len += timing_row(report + len, "total", elapsed_us(&timer->start),
+                      user_us, sys_us, maxrss, vcsw, ivcsw);
+
+    fflush(stdout);
+    for (size_t off = 0; off < len;) {
+        ssize_t n = write(STDERR_FILENO, report + off, len - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        off += n;
+    }
+
+    free(usage);
+    free(wall_us);
+    free(done);
+    free(report);
+    return status;
+}
+
+
+int *execute_line(Command *head){
     
-    // debugging
+    // handle empty command, nothing to execute
+    if (!head) {
+        return NULL;
+    }
+
     #ifdef DEBUG
     printf("\n***********************\n");
     printf("BEGIN: Executing line...\n");
     #endif
 
+    // initialize and allocate return status
+    int *return_status = malloc(sizeof(int));
+    
+    // error checking
+    if (!return_status) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // background jobs that finished since the last line
+    jobs_reap();
+
+    // like sh, a background job does not read the shell's input
+    if (head->background && head->redir_in_path == NULL &&
+        head->stdin_fd == STDIN_FILENO) {
+        head->redir_in_path = "/dev/null";
+    }
+
+    // a background line is never waited for, so there is nothing to time
+    int timed = (head->timed || time_every_line) && !head->background;
+    LineTimer timer;
+    if (timed) {
+        clock_gettime(CLOCK_MONOTONIC, &timer.start);
+        getrusage(RUSAGE_SELF, &timer.self_before);
+    }
+
+    size_t num_cmds;
+    int known_status;
+    pid_t *pids = start_line(head, &num_cmds, &known_status);
+    if (timed) {
+        timer.launch_us = elapsed_us(&timer.start);
+    }
+    if (pids == NULL) {
+        free(return_status);
+        return (int *) -1;
+    }
+    *return_status = known_status < 0 ? 0 : known_status;
+
     #ifdef DEBUG
     printf("All children created\n");
     #endif
 
+    // a background line becomes a job instead of being waited for; its
+    // builtins were forked too, so even echo x & has a pid for $!
+    if (head->background) {
+        size_t num_pids = 0;
+        for (size_t j = 0; j < num_cmds; j++) {
+            if (pids[j] > 0) {
+                pids[num_pids++] = pids[j];
+            }
+        }
+        if (num_pids > 0 &&
+            jobs_add(head, pids, num_pids, known_status) > 0) {
+            set_status_variable("!", pids[num_pids - 1]);
+        }
+        num_cmds = 0;
+        *return_status = 0;
+    }
+
+    if (timed) {
+        *return_status = wait_timed(head, pids, num_cmds, &timer, *return_status);
+        num_cmds = 0;
+    }
+
     // Wait for all the children to finish
+    for (size_t j = 0; j < num_cmds; j++) {
+        if (pids[j] <= 0) {
+            continue;
+        }
+        int status;
+        trace_begin("waitpid");
+        while (waitpid(pids[j], &status, 0) == -1) {
+            if (errno != EINTR) {
+                perror("waitpid");
+                status = 0;
+                break;
+            }
+        }
+        trace_end("waitpid");
+        trace_child_exited(pids[j], status);
+        // the line's status is the last stage's
+        if (j == num_cmds - 1) {
+            *return_status = status_to_exit_code(status);
+        }
+    }
+    free(pids);
 
     #ifdef DEBUG
     printf("All children finished\n");
-    #endif
-
-    #ifdef DEBUG
     printf("END: Executing line...\n");
     printf("***********************\n\n");
     #endif
+
+    set_status_variable("?", *return_status);
+    return return_status;
+}
+
+
+void set_launch_mode(LaunchMode mode){
+    launch_mode = mode;
+}
+
+/*
+** The posix_spawn backend of run_command. glibc implements posix_spawn
+** with clone(CLONE_VM|CLONE_VFORK), so nothing of the shell's address
+** space is copied no matter how large it grows. The fd setup the fork
+** path does by hand is expressed as file actions instead; they run in
+** the same order (pipe ends, then explicit redirections).
+**
+** Returns the child pid, -1 if no process could be created, or 0 if
+** the command itself could not be started (already reported).
+*/
+static int spawn_command(Command *command){
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t no_signals;
+    pid_t pid;
+    int err;
+
+    if ((err = posix_spawn_file_actions_init(&actions)) != 0) {
+        errno = err;
+        perror("posix_spawn_file_actions_init");
+        return -1;
+    }
+    if ((err = posix_spawnattr_init(&attr)) != 0) {
+        errno = err;
+        perror("posix_spawnattr_init");
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+
+    // children start with nothing blocked, whatever the shell is doing
+    sigemptyset(&no_signals);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    // pipe ends are close-on-exec, so only the dup'd copies survive
+    if (command->stdin_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, command->stdin_fd,
+                                         STDIN_FILENO);
+    }
+    if (command->stdout_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, command->stdout_fd,
+                                         STDOUT_FILENO);
+    }
+    if (command->redir_in_path != NULL) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+                                         command->redir_in_path, O_RDONLY, 0);
+    }
+    if (command->redir_out_path != NULL) {
+        int flags = O_WRONLY | O_CREAT | (command->redir_append ? O_APPEND : O_TRUNC);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+                                         command->redir_out_path, flags, 0644);
+    }
+
+    err = posix_spawn(&pid, command->exec_path, &actions, &attr,
+                      command->args, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err == EAGAIN || err == ENOMEM) {
+        errno = err;
+        perror("posix_spawn");
+        return -1;
+    }
+    if (err != 0) {
+        // a bad redirection or exec failure, like a child that exits 1
+        fprintf(stderr, "%s: %s\n", command->exec_path, strerror(err));
+        return 0;
+    }
+    return pid;
 }
 
 
@@ -120,40 +877,63 @@ int *execute_line(Command *head){
 */
 int run_command(Command *command){
     
-    // if the command, args[0] is cd, use cd_cscshell to handle it, otherwise, go to home directory if none specified
-    if(strcmp(command->exec_path, "cd") == 0) {
-        
-        if(command->args[1] != NULL) {
-            cd_cscshell(command->args[1]);
-        }
+    // don't let the child inherit (and later flush) our buffered output
+    fflush(stdout);
 
-        else {
-            cd_cscshell(NULL);
+    if (launch_mode == LAUNCH_ZYGOTE) {
+        trace_begin("zygote");
+        pid_t pid = zygote_launch(command);
+        trace_end("zygote");
+        if (pid != -2) {
+            trace_child_started(pid, command->args[0]);
+            return pid;
         }
+        // the zygote is gone, spawn from here on
+        launch_mode = LAUNCH_SPAWN;
+    }
 
-        return 0;
+    if (launch_mode == LAUNCH_SPAWN) {
+        trace_begin("posix_spawn");
+        pid_t pid = spawn_command(command);
+        trace_end("posix_spawn");
+        trace_child_started(pid, command->args[0]);
+        return pid;
     }
-    
+
     // create fork and error check
+    trace_begin("fork");
     pid_t pid = fork();
     if (pid == -1) {
         perror("fork failed");
+        trace_end("fork");
         return -1;
     }
 
-    // child process
+    // child process; it must _exit so stdio doesn't flush (or rewind)
+    // streams it shares with the shell, like an open script file
     if (pid == 0) {
 
+        // pipe ends from execute_line; explicit redirections below win
+        if (command->stdin_fd != STDIN_FILENO &&
+            dup2(command->stdin_fd, STDIN_FILENO) == -1) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+        if (command->stdout_fd != STDOUT_FILENO &&
+            dup2(command->stdout_fd, STDOUT_FILENO) == -1) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+
         // input redirection
         if (command->redir_in_path != NULL) {
             int in_fd = open(command->redir_in_path, O_RDONLY);
             
             if (in_fd == -1) {
                 perror("open");
-                exit(EXIT_FAILURE);
+                _exit(EXIT_FAILURE);
             }
 
-            dup2(in_fd, STDIN_FILENO);
             if (dup2(in_fd, STDIN_FILENO) == -1) {
                 perror("dup2");
                 close(in_fd);
@@ -169,7 +949,7 @@ int run_command(Command *command){
 
             if (out_fd == -1) {
                 perror("open");
-                exit(EXIT_FAILURE);
+                _exit(EXIT_FAILURE);
             }
 
             if (dup2(out_fd, STDOUT_FILENO) == -1) {
@@ -180,84 +960,86 @@ int run_command(Command *command){
             close(out_fd);
         }
 
-        // execute the command annd handle failure
-        execvp(command->exec_path, command->args);
-        perror("execvp ");
-        exit(EXIT_FAILURE);
+        // exec_path was resolved (and hashed) by the parser, no PATH walk
+        execve(command->exec_path, command->args, environ);
+        perror("execve ");
+        _exit(EXIT_FAILURE);
     }
 
+    trace_end("fork");
+    trace_child_started(pid, command->args[0]);
     return pid;
 }
 
 
-int run_script(char *file_path, Variable **root){
-    
-    // Attempt to open the specified script file, exit with error if unsuccessful
-    FILE *script_file = fopen(file_path, "r");
-    if (!script_file) {
-        return -1;  // Return an error code if file opening fails
+int run_script(char *file_path, VarTable *root){
+
+    ScriptReader reader;
+    if (reader_open(&reader, file_path) < 0) {
+        return -1;
     }
 
-    char buffer[MAX_SINGLE_LINE];
+    if (parallel_jobs() > 1) {
+        int ret = run_script_parallel(&reader, root);
+        reader_close(&reader);
+        return ret;
+    }
 
-    // Read and process each line in the script file
+    // a compiled copy saves lexing every line again
+    int ret = run_script_cached(&reader, root);
+    if (ret != -2) {
+        reader_close(&reader);
+        return ret;
+    }
 
-    while (fgets(buffer, sizeof(buffer), script_file)) {
+    Arena arena = {0};
+    ret = 1;
 
-        // eliminate the newline character at the end of the line
-        buffer[strcspn(buffer, "\n")] = '\0';
+    // Read and process each line in the script file
+    char *line;
+    while ((line = reader_next(&reader)) != NULL) {
+        if (line == (char *) -1) {
+            ret = -1;
+            break;
+        }
+
+        // an if, while or for reads the rest of its block itself
+        if (is_block_line(line)) {
+            int block = run_block(line, reader_source, &reader, root);
+            if (block <= 0) {
+                ret = block < 0 ? -1 : ret;
+                break;
+            }
+            continue;
+        }
 
         // convert line into executable commands
-        Command *cmd = parse_line(buffer, root);
-        
+        Command *cmd = parse_line(line, root, &arena);
+
         if (cmd == (Command *) -1) {
-            fclose(script_file);
-            return -1;
+            ret = -1;
+            break;
         }
 
         // execute the commands, if valid
         if (cmd) {
             int *result = execute_line(cmd);
             if (result == (int *) -1) {
-                free(result);
-                fclose(script_file);
-                return -1;
+                ret = -1;
+                break;
             }
             free(result);
         }
-        // free any allocated resources for the command
-        free_command(cmd);
-    }
 
-    // close the script file
-    fclose(script_file);
-    return 1;
-}
-
-void free_command(Command *command){
-
-    // iterate through all commands
-    while (command != NULL) {
+        // everything the line allocated goes at once
+        arena_reset(&arena);
 
-        // move to next command if there is one
-        Command *next_command = command->next;
-        
-        // first, free executable path
-        free(command->exec_path);
-
-        // next, free array of arguments
-        if (command->args != NULL) {
-            free(command->args);
-            command->args = NULL;
+        if (exit_requested(NULL)) {
+            break;
         }
-
-        // then free input/output redirection path
-        free(command->redir_in_path);
-        free(command->redir_out_path);
- 
-        // completely free current command struct
-        free(command);
-
-        command = next_command;
     }
+
+    arena_free(&arena);
+    reader_close(&reader);
+    return ret;
 }
@@ -0,0 +1,457 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <sys/mman.h>
+
+/*
+** Precompiled scripts. The first time a script runs, every line is
+** compiled into a LineTemplate as it is reached; if the whole script
+** compiled, the templates are written to <dir>/<hash of path>.cscc.
+** Later runs map that file and go straight to instantiate_line, without
+** lexing a single line.
+**
+** The file is a header followed by the templates laid out exactly as in
+** memory, except that every pointer holds an offset from the start of
+** the file (0 for NULL). It is mapped MAP_PRIVATE and the pointers are
+** fixed up in place, so only the pages touched by relocation are ever
+** copied. A cache is used only if the script's size, mtime and content
+** hash all match what the header recorded; anything else (including a
+** different build of the shell) means the script is compiled again.
+*/
+
+#define SCRIPT_CACHE_MAGIC 0x63637363 /* "cscc" */
+#define SCRIPT_CACHE_VERSION 5
+#define SCRIPT_CACHE_INIT_LINES 64
+
+typedef struct ScriptCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t word_size;
+    uint32_t num_lines;
+    uint64_t script_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t content_hash;
+    uint64_t path_off;
+    uint64_t lines_off;
+    uint64_t total_len;
+} ScriptCacheHeader;
+
+static char *cache_dir = NULL;
+
+
+/* Writing */
+
+// a growing buffer that is addressed by offset while it is being built
+typedef struct Blob {
+    char *data;
+    size_t len;
+    size_t cap;
+} Blob;
+
+#define BLOB_AT(blob, type, off) ((type *)((blob)->data + (off)))
+#define AS_OFFSET(type, off) ((type)(uintptr_t)(off))
+
+// returns the offset of size zeroed bytes, aligned for any template struct
+static size_t blob_alloc(Blob *blob, size_t size){
+    size_t off = (blob->len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (off + size > blob->cap){
+        size_t new_cap = blob->cap ? blob->cap : 4096;
+        while (new_cap < off + size){
+            new_cap *= 2;
+        }
+        char *grown = realloc(blob->data, new_cap);
+        if (grown == NULL){
+            perror("script cache");
+            exit(EXIT_FAILURE);
+        }
+        blob->data = grown;
+        blob->cap = new_cap;
+    }
+    memset(blob->data + blob->len, 0, off + size - blob->len);
+    blob->len = off + size;
+    return off;
+}
+
+static size_t put_string(Blob *blob, const char *str, size_t len){
+    size_t off = blob_alloc(blob, len + 1);
+    memcpy(blob->data + off, str, len);
+    return off;
+}
+
+static void put_line(Blob *blob, size_t line_off, const LineTemplate *tmpl);
+
+// lays out the parts of word and stores the Word at word_off
+static void put_word(Blob *blob, size_t word_off, const Word *word){
+    size_t parts = 0;
+    if (word->num_parts > 0){
+        parts = blob_alloc(blob, word->num_parts * sizeof(WordPart));
+    }
+    for (size_t i = 0; i < word->num_parts; i++){
+        size_t text = put_string(blob, word->parts[i].text, word->parts[i].len);
+        // the compiled line of a $(...) goes along with it
+        size_t line = 0;
+        if (word->parts[i].line != NULL){
+            line = blob_alloc(blob, sizeof(LineTemplate));
+            put_line(blob, line, word->parts[i].line);
+        }
+        WordPart *part = BLOB_AT(blob, WordPart, parts) + i;
+        *part = word->parts[i];
+        part->text = AS_OFFSET(const char *, text);
+        part->line = AS_OFFSET(LineTemplate *, line);
+    }
+    BLOB_AT(blob, Word, word_off)->parts = AS_OFFSET(WordPart *, parts);
+    BLOB_AT(blob, Word, word_off)->num_parts = word->num_parts;
+}
+
+static size_t put_redirection(Blob *blob, const Word *word){
+    if (word == NULL){
+        return 0;
+    }
+    size_t off = blob_alloc(blob, sizeof(Word));
+    put_word(blob, off, word);
+    return off;
+}
+
+static void put_line(Blob *blob, size_t line_off, const LineTemplate *tmpl){
+    if (tmpl->assign_name != NULL){
+        size_t name = put_string(blob, tmpl->assign_name,
+                                 strlen(tmpl->assign_name));
+        BLOB_AT(blob, LineTemplate, line_off)->assign_name =
+            AS_OFFSET(char *, name);
+        put_word(blob, line_off + offsetof(LineTemplate, assign_value),
+                 &tmpl->assign_value);
+    }
+
+    size_t stages = 0;
+    if (tmpl->num_stages > 0){
+        stages = blob_alloc(blob, tmpl->num_stages * sizeof(StageTemplate));
+    }
+    for (size_t s = 0; s < tmpl->num_stages; s++){
+        const StageTemplate *src = &tmpl->stages[s];
+        size_t words = 0;
+        if (src->num_words > 0){
+            words = blob_alloc(blob, src->num_words * sizeof(Word));
+        }
+        for (size_t w = 0; w < src->num_words; w++){
+            put_word(blob, words + w * sizeof(Word), &src->words[w]);
+        }
+        size_t redir_in = put_redirection(blob, src->redir_in);
+        size_t redir_out = put_redirection(blob, src->redir_out);
+
+        StageTemplate *dst = BLOB_AT(blob, StageTemplate, stages) + s;
+        dst->words = AS_OFFSET(Word *, words);
+        dst->num_words = src->num_words;
+        dst->redir_in = AS_OFFSET(Word *, redir_in);
+        dst->redir_out = AS_OFFSET(Word *, redir_out);
+        dst->redir_append = src->redir_append;
+    }
+    BLOB_AT(blob, LineTemplate, line_off)->stages =
+        AS_OFFSET(StageTemplate *, stages);
+    BLOB_AT(blob, LineTemplate, line_off)->num_stages = tmpl->num_stages;
+    BLOB_AT(blob, LineTemplate, line_off)->background = tmpl->background;
+    BLOB_AT(blob, LineTemplate, line_off)->timed = tmpl->timed;
+}
+
+static void write_cache(const char *cache_file, const char *script_path,
+                        const ScriptCacheHeader *key,
+                        LineTemplate **lines, size_t num_lines){
+    Blob blob = {0};
+    blob_alloc(&blob, sizeof(ScriptCacheHeader));
+    size_t path_off = put_string(&blob, script_path, strlen(script_path));
+    size_t lines_off = blob_alloc(&blob, num_lines * sizeof(LineTemplate));
+    for (size_t i = 0; i < num_lines; i++){
+        put_line(&blob, lines_off + i * sizeof(LineTemplate), lines[i]);
+    }
+
+    ScriptCacheHeader *header = BLOB_AT(&blob, ScriptCacheHeader, 0);
+    *header = *key;
+    header->num_lines = num_lines;
+    header->path_off = path_off;
+    header->lines_off = lines_off;
+    header->total_len = blob.len;
+
+    // a cache that cannot be written just means compiling next time
+    write_file_atomic(cache_file, blob.data, blob.len);
+    free(blob.data);
+}
+
+
+/* Reading */
+
+typedef struct Mapping {
+    char *base;
+    size_t len;
+    int bad;
+} Mapping;
+
+// turns an offset stored in a pointer field back into a pointer to count
+// elements of size bytes, flagging the mapping if it points outside it
+static void *relocate(Mapping *map, const void *stored, size_t count,
+                      size_t size){
+    uintptr_t off = (uintptr_t) stored;
+    if (off == 0){
+        return NULL;
+    }
+    if (off >= map->len || count > (map->len - off) / size){
+        map->bad = 1;
+        return NULL;
+    }
+    return map->base + off;
+}
+
+static void relocate_line(Mapping *map, LineTemplate *tmpl);
+
+static void relocate_word(Mapping *map, Word *word){
+    word->parts = relocate(map, word->parts, word->num_parts, sizeof(WordPart));
+    for (size_t i = 0; word->parts != NULL && i < word->num_parts; i++){
+        WordPart *part = &word->parts[i];
+        part->text = relocate(map, part->text, part->len + 1, 1);
+        part->line = relocate(map, part->line, 1, sizeof(LineTemplate));
+        if (part->line != NULL){
+            relocate_line(map, part->line);
+        }
+    }
+}
+
+static void relocate_line(Mapping *map, LineTemplate *tmpl){
+    if (tmpl->assign_name != NULL){
+        tmpl->assign_name = relocate(map, tmpl->assign_name, 1, 1);
+        relocate_word(map, &tmpl->assign_value);
+    }
+    tmpl->stages = relocate(map, tmpl->stages, tmpl->num_stages,
+                            sizeof(StageTemplate));
+    for (size_t s = 0; tmpl->stages != NULL && s < tmpl->num_stages; s++){
+        StageTemplate *stage = &tmpl->stages[s];
+        stage->words = relocate(map, stage->words, stage->num_words,
+                                sizeof(Word));
+        for (size_t w = 0; stage->words != NULL && w < stage->num_words; w++){
+            relocate_word(map, &stage->words[w]);
+        }
+        stage->redir_in = relocate(map, stage->redir_in, 1, sizeof(Word));
+        if (stage->redir_in != NULL){
+            relocate_word(map, stage->redir_in);
+        }
+        stage->redir_out = relocate(map, stage->redir_out, 1, sizeof(Word));
+        if (stage->redir_out != NULL){
+            relocate_word(map, stage->redir_out);
+        }
+    }
+}
+
+/*
+** Maps cache_file if it was built from this exact script and fixes up
+** its pointers. Returns the line templates (the mapping is returned
+** through map), or NULL if there is no usable cache.
+*/
+static LineTemplate *load_cache(const char *cache_file, const char *script_path,
+                                const ScriptCacheHeader *key, Mapping *map){
+    int fd = open(cache_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(ScriptCacheHeader)){
+        close(fd);
+        return NULL;
+    }
+    map->len = st.st_size;
+    map->base = mmap(NULL, map->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map->base == MAP_FAILED){
+        map->base = NULL;
+        return NULL;
+    }
+    map->bad = 0;
+
+    ScriptCacheHeader *header = (ScriptCacheHeader *) map->base;
+    if (header->magic != key->magic || header->version != key->version ||
+        header->word_size != key->word_size ||
+        header->script_size != key->script_size ||
+        header->mtime_sec != key->mtime_sec ||
+        header->mtime_nsec != key->mtime_nsec ||
+        header->content_hash != key->content_hash ||
+        header->total_len != map->len){
+        goto load_fail;
+    }
+
+    size_t path_len = strlen(script_path);
+    const char *path = relocate(map, (void *)(uintptr_t) header->path_off,
+                                path_len + 1, 1);
+    if (path == NULL || memcmp(path, script_path, path_len + 1) != 0){
+        goto load_fail;
+    }
+
+    LineTemplate *lines = relocate(map, (void *)(uintptr_t) header->lines_off,
+                                   header->num_lines, sizeof(LineTemplate));
+    if (lines == NULL && header->num_lines > 0){
+        goto load_fail;
+    }
+    for (size_t i = 0; i < header->num_lines && !map->bad; i++){
+        relocate_line(map, &lines[i]);
+    }
+    if (map->bad){
+        goto load_fail;
+    }
+    return lines;
+
+load_fail:
+    munmap(map->base, map->len);
+    map->base = NULL;
+    return NULL;
+}
+
+
+/* Running */
+
+// instantiates and executes one template; returns 1 to go on, 0 if the
+// script ran exit, -1 on error
+static int run_template(LineTemplate *tmpl, VarTable *root, Arena *arena){
+    Command *cmd = instantiate_line(tmpl, root, arena);
+    if (cmd == (Command *) -1){
+        return -1;
+    }
+    if (cmd){
+        int *result = execute_line(cmd);
+        if (result == (int *) -1){
+            return -1;
+        }
+        free(result);
+    }
+    arena_reset(arena);
+    return exit_requested(NULL) ? 0 : 1;
+}
+
+// the script's path with symlinks resolved, through /proc so that it
+// names the file that was actually opened
+static char *realpath_of(int fd){
+    char link[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    return realpath(link, NULL);
+}
+
+// <cache_dir>/<hash of the script's real path>.cscc
+static char *cache_file_for(const char *script_path){
+    size_t len = strlen(cache_dir) + 2 * sizeof(size_t) + sizeof("/.cscc");
+    char *file = malloc(len);
+    if (file != NULL){
+        snprintf(file, len, "%s/%0*zx.cscc", cache_dir, (int)(2 * sizeof(size_t)),
+                 hash_bytes(script_path, strlen(script_path)));
+    }
+    return file;
+}
+
+
+int script_cache_open(const char *dir){
+    free(cache_dir);
+    cache_dir = strdup(dir);
+    if (cache_dir == NULL){
+        perror("script_cache_open");
+        return -1;
+    }
+    return 0;
+}
+
+int script_cache_enabled(){
+    return cache_dir != NULL;
+}
+
+void script_cache_close(){
+    free(cache_dir);
+    cache_dir = NULL;
+}
+
+
+int run_script_cached(ScriptReader *reader, VarTable *root){
+    // only a mapped script can be hashed up front
+    if (cache_dir == NULL || reader->map == NULL){
+        return -2;
+    }
+    const struct stat *st = &reader->st;
+
+    char *script_path = realpath_of(reader->fd);
+    char *cache_file = script_path ? cache_file_for(script_path) : NULL;
+    if (cache_file == NULL){
+        free(script_path);
+        return -2;
+    }
+
+    ScriptCacheHeader key = {0};
+    key.magic = SCRIPT_CACHE_MAGIC;
+    key.version = SCRIPT_CACHE_VERSION;
+    key.word_size = sizeof(void *);
+    key.script_size = st->st_size;
+    key.mtime_sec = st->st_mtim.tv_sec;
+    key.mtime_nsec = st->st_mtim.tv_nsec;
+    key.content_hash = hash_bytes(reader->map, st->st_size);
+
+    Arena arena = {0};
+    int ret = 1;
+
+    Mapping map = {0};
+    LineTemplate *cached = load_cache(cache_file, script_path, &key, &map);
+    if (cached != NULL || map.base != NULL){
+        size_t num_lines = ((ScriptCacheHeader *) map.base)->num_lines;
+        for (size_t i = 0; i < num_lines && ret > 0; i++){
+            ret = run_template(&cached[i], root, &arena);
+        }
+        munmap(map.base, map.len);
+    }
+
+    else {
+        // compile as we go, keeping every template for the cache
+        Arena tmpl_arena = {0};
+        LineTemplate **lines = NULL;
+        size_t num_lines = 0;
+        size_t cap = 0;
+        int has_blocks = 0;
+
+        char *line;
+        while (ret > 0 && (line = reader_next(reader)) != NULL){
+            if (line == (char *) -1){
+                ret = -1;
+                break;
+            }
+
+            // blocks are compiled by run_block, and never cached
+            if (is_block_line(line)){
+                has_blocks = 1;
+                ret = run_block(line, reader_source, reader, root);
+                continue;
+            }
+
+            LineTemplate *tmpl = compile_line(line, &tmpl_arena);
+            if (tmpl == (LineTemplate *) -1){
+                ret = -1;
+                break;
+            }
+            if (num_lines == cap){
+                cap = cap ? cap * 2 : SCRIPT_CACHE_INIT_LINES;
+                LineTemplate **grown = realloc(lines, cap * sizeof(LineTemplate *));
+                if (grown == NULL){
+                    perror("run_script");
+                    ret = -1;
+                    break;
+                }
+                lines = grown;
+            }
+            lines[num_lines++] = tmpl;
+
+            ret = run_template(tmpl, root, &arena);
+        }
+
+        if (ret > 0 && !has_blocks){
+            write_cache(cache_file, script_path, &key, lines, num_lines);
+        }
+        free(lines);
+        arena_free(&tmpl_arena);
+    }
+
+    arena_free(&arena);
+    free(cache_file);
+    free(script_path);
+    return ret < 0 ? -1 : 1;
+}
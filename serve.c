@@ -0,0 +1,414 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+** Daemon mode. `cscshell --serve=SOCKET` runs the init file once and
+** then listens on a Unix socket; `cscshell --client=SOCKET [SCRIPT]`
+** (or `-c COMMAND`, or a script on stdin) has it run a script as if the
+** client had been started as a shell of its own. An existing file at
+** SOCKET is only replaced if it is a socket. The socket is created with
+** mode 0600, and connections from any other user are closed unread.
+**
+** A request is a ServeRequest and the client's environment as NUL
+** terminated strings, with the client's stdin, stdout and stderr, its
+** working directory and (unless the script is stdin) the script passed
+** as SCM_RIGHTS. A -c command goes in a memfd, so every script is an
+** fd. Each request runs in a worker forked from the server, so the
+** variables of the init file are there already and nothing a script
+** does outlives it. The worker's environment is the client's plus what
+** the init file exported; nothing else of the server's is kept. The
+** worker sends the script's exit status back on the connection. The
+** server keeps the pids of its workers and reaps only those, whenever
+** a connection comes in and at least every SERVE_REAP_MS while idle.
+**
+** To keep the command hash warm, each worker also sends the names it
+** hashed to the server (over a datagram socketpair), which resolves
+** them itself before it forks the next worker.
+*/
+
+#define SERVE_BACKLOG 64
+#define SERVE_SCRIPT_STDIN 0x1
+#define SERVE_NUM_FDS 5
+#define SERVE_NAMES_MAX 65536
+#define SERVE_REAP_MS 1000
+
+typedef struct ServeRequest {
+    uint32_t flags;
+    uint32_t envc;
+    uint32_t len;
+} ServeRequest;
+
+// the workers that have not been reaped yet
+static pid_t *workers = NULL;
+static size_t num_workers = 0;
+static size_t workers_cap = 0;
+
+static int add_worker(pid_t pid){
+    if (num_workers == workers_cap){
+        size_t new_cap = workers_cap ? workers_cap * 2 : 16;
+        pid_t *grown = realloc(workers, new_cap * sizeof(pid_t));
+        if (grown == NULL){
+            perror("serve");
+            return -1;
+        }
+        workers = grown;
+        workers_cap = new_cap;
+    }
+    workers[num_workers++] = pid;
+    return 0;
+}
+
+// reaps the workers that have finished, and no other child
+static void reap_workers(){
+    for (size_t i = 0; i < num_workers;){
+        pid_t pid;
+        while ((pid = waitpid(workers[i], NULL, WNOHANG)) == -1 && errno == EINTR){}
+        if (pid == 0){
+            i++;
+            continue;
+        }
+        workers[i] = workers[--num_workers];
+    }
+}
+
+// whether the process at the other end of conn runs as this user
+static int peer_is_owner(int conn){
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+        cred.uid == getuid();
+}
+
+static int send_full(int fd, const void *buf, size_t len){
+    for (size_t off = 0; off < len;){
+        ssize_t n = send(fd, (const char *) buf + off, len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n < 0){
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+static int recv_full(int fd, void *buf, size_t len){
+    for (size_t off = 0; off < len;){
+        ssize_t n = recv(fd, (char *) buf + off, len - off, 0);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+static int socket_address(const char *path, struct sockaddr_un *addr){
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)){
+        ERR_PRINT(ERR_SOCKET_PATH, path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// resolves every name workers have sent since the last connection
+static void learn_names(int learn_fd, VarTable *root){
+    static char names[SERVE_NAMES_MAX];
+    ssize_t n;
+    while ((n = recv(learn_fd, names, sizeof(names), MSG_DONTWAIT)) > 0){
+        for (char *name = names; name < names + n; name += strlen(name) + 1){
+            free(hash_resolve(name, root->path));
+        }
+    }
+}
+
+/*
+** The forked worker: takes the request off conn, becomes the client's
+** shell and runs its script. Never returns.
+*/
+static void serve_worker(int conn, int learn_fd, VarTable *root){
+    ServeRequest req;
+    int fds[SERVE_NUM_FDS];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL)) == -1 &&
+           errno == EINTR){}
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    size_t num_fds = 0;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+        num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+    }
+    size_t expected = (req.flags & SERVE_SCRIPT_STDIN) ? SERVE_NUM_FDS - 1 : SERVE_NUM_FDS;
+    char *env = n == sizeof(req) ? malloc(req.len + 1) : NULL;
+    if (env == NULL || num_fds != expected || recv_full(conn, env, req.len) < 0){
+        _exit(EXIT_FAILURE);
+    }
+    env[req.len] = '\0';
+
+    // the client's stdio and working directory
+    for (int fd = 0; fd < 3; fd++){
+        dup2(fds[fd], fd);
+        close(fds[fd]);
+    }
+    if (fchdir(fds[3]) == -1){
+        perror("fchdir");
+    }
+    close(fds[3]);
+    prompt_cwd_changed();
+
+    // what the init file exported: variables of the shell that are in
+    // the environment with the same value (nothing else sets both)
+    size_t num_exported = 0;
+    for (Variable *v = root->head; v != NULL; v = v->next){
+        num_exported++;
+    }
+    Variable **exported = malloc((num_exported ? num_exported : 1) * sizeof(Variable *));
+    if (exported == NULL){
+        _exit(EXIT_FAILURE);
+    }
+    num_exported = 0;
+    for (Variable *v = root->head; v != NULL; v = v->next){
+        char *value = getenv(v->name);
+        if (value != NULL && strcmp(value, v->value) == 0){
+            exported[num_exported++] = v;
+        }
+    }
+
+    // the client's environment, not the server's, with those on top
+    clearenv();
+    char *var = env;
+    for (uint32_t i = 0; i < req.envc && var < env + req.len; i++){
+        putenv(var);
+        var += strlen(var) + 1;
+    }
+    for (size_t i = 0; i < num_exported; i++){
+        setenv(exported[i]->name, exported[i]->value, 1);
+    }
+    free(exported);
+
+    char script[32] = "-";
+    if (!(req.flags & SERVE_SCRIPT_STDIN)){
+        snprintf(script, sizeof(script), "/dev/fd/%d", fds[4]);
+    }
+    int ret_code = run_script(script, root);
+    exit_requested(&ret_code);
+    fflush(stdout);
+
+    static char names[SERVE_NAMES_MAX];
+    size_t len = hash_names(names, sizeof(names));
+    if (len > 0){
+        send(learn_fd, names, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    int32_t status = ret_code;
+    send_full(conn, &status, sizeof(status));
+    _exit(ret_code & 0xff);
+}
+
+
+int serve(const char *socket_path, VarTable *root){
+    struct sockaddr_un addr;
+    if (socket_address(socket_path, &addr) < 0){
+        return -1;
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1){
+        perror("socket");
+        return -1;
+    }
+    // a socket left behind by an earlier server, but nothing else
+    struct stat st;
+    if (lstat(socket_path, &st) == 0){
+        if (!S_ISSOCK(st.st_mode)){
+            ERR_PRINT(ERR_NOT_SOCKET, socket_path);
+            close(listen_fd);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+    // only this user may connect: the socket is 0600 from the start
+    mode_t old_mask = umask(0177);
+    int bound = bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(old_mask);
+    if (bound == -1 || listen(listen_fd, SERVE_BACKLOG) == -1){
+        perror(socket_path);
+        close(listen_fd);
+        return -1;
+    }
+    int learn[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, learn) == -1){
+        perror("socketpair");
+        close(listen_fd);
+        return -1;
+    }
+
+    for (;;){
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, SERVE_REAP_MS);
+        reap_workers();
+        if (ready == -1 && errno != EINTR){
+            perror("poll");
+            break;
+        }
+        if (ready <= 0){
+            continue;
+        }
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1){
+            if (errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+        if (!peer_is_owner(conn)){
+            close(conn);
+            continue;
+        }
+        learn_names(learn[0], root);
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == -1){
+            perror("fork failed");
+        }
+        else if (pid == 0){
+            close(listen_fd);
+            close(learn[0]);
+            trace_forked();
+            zygote_forked();
+            serve_worker(conn, learn[1], root);
+        }
+        else {
+            // one that cannot be tracked stays a zombie until the server exits
+            add_worker(pid);
+        }
+        close(conn);
+    }
+
+    reap_workers();
+    free(workers);
+    workers = NULL;
+    num_workers = workers_cap = 0;
+    close(listen_fd);
+    close(learn[0]);
+    close(learn[1]);
+    unlink(socket_path);
+    return -1;
+}
+
+
+int serve_client(const char *socket_path, const char *script, const char *command){
+    struct sockaddr_un addr;
+    if (socket_address(socket_path, &addr) < 0){
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1){
+        perror("socket");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1){
+        perror(socket_path);
+        close(sock);
+        return -1;
+    }
+
+    ServeRequest req;
+    memset(&req, 0, sizeof(req));
+    int fds[SERVE_NUM_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, -1, -1};
+    size_t num_fds = SERVE_NUM_FDS;
+    fds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (command != NULL){
+        fds[4] = memfd_create("cscshell-command", MFD_CLOEXEC);
+        if (fds[4] != -1 && (write(fds[4], command, strlen(command)) < 0 ||
+                             write(fds[4], "\n", 1) < 0)){
+            close(fds[4]);
+            fds[4] = -1;
+        }
+    }
+    else if (script != NULL && strcmp(script, "-") != 0){
+        fds[4] = open(script, O_RDONLY | O_CLOEXEC);
+    }
+    else {
+        req.flags |= SERVE_SCRIPT_STDIN;
+        num_fds--;
+    }
+    if (fds[3] == -1 || (num_fds == SERVE_NUM_FDS && fds[4] == -1)){
+        perror(script ? script : "cscshell");
+        close(sock);
+        return -1;
+    }
+
+    size_t len = 0;
+    for (; environ[req.envc] != NULL; req.envc++){
+        len += strlen(environ[req.envc]) + 1;
+    }
+    char *env = malloc(len ? len : 1);
+    if (env == NULL){
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    req.len = 0;
+    for (uint32_t i = 0; i < req.envc; i++){
+        size_t var_len = strlen(environ[i]) + 1;
+        memcpy(env + req.len, environ[i], var_len);
+        req.len += var_len;
+    }
+
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+
+    int32_t status = -1;
+    ssize_t sent;
+    while ((sent = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR){}
+    if (sent != sizeof(req) || send_full(sock, env, req.len) < 0 ||
+        recv_full(sock, &status, sizeof(status)) < 0){
+        fprintf(stderr, "cscshell: no status from the server at %s\n", socket_path);
+        status = -1;
+    }
+
+    free(env);
+    close(fds[3]);
+    if (num_fds == SERVE_NUM_FDS){
+        close(fds[4]);
+    }
+    close(sock);
+    return status;
+}
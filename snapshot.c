@@ -0,0 +1,273 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+/*
+** Init file snapshots. An init file made only of assignments (and
+** blank or comment lines) always leaves the same variables behind, so
+** once it has run they are saved to <dir>/<hash of path>.snap, and
+** later launches read that file back instead of running the init file.
+**
+** The file is a header followed by the init file's path and then each
+** variable, in the order it was first assigned, as name and value NUL
+** terminated. Like a compiled script, a snapshot is used only if the
+** init file's size, mtime and content hash all match its header. An
+** init file with any other line (a command, a background or timed
+** line) or a $(...) in a value is never snapshotted and runs through
+** run_script every time.
+*/
+
+#define SNAPSHOT_MAGIC 0x70616e73 /* "snap" */
+#define SNAPSHOT_VERSION 1
+
+typedef struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_vars;
+    uint32_t path_len;
+    uint64_t init_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t content_hash;
+    uint64_t total_len;
+} SnapshotHeader;
+
+static char *snapshot_dir = NULL;
+
+
+// <snapshot_dir>/<hash of the init file's real path>.snap
+static char *snapshot_file_for(const char *init_path){
+    size_t len = strlen(snapshot_dir) + 2 * sizeof(size_t) + sizeof("/.snap");
+    char *file = malloc(len);
+    if (file != NULL){
+        snprintf(file, len, "%s/%0*zx.snap", snapshot_dir, (int)(2 * sizeof(size_t)),
+                 hash_bytes(init_path, strlen(init_path)));
+    }
+    return file;
+}
+
+/*
+** Sets the variables saved in file if it is a snapshot of this exact
+** init file. Returns 0 if it was, -1 if there is no usable snapshot.
+*/
+static int load_snapshot(const char *file, const char *init_path,
+                         const SnapshotHeader *key, VarTable *root){
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+        return -1;
+    }
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(SnapshotHeader)){
+        data = malloc(st.st_size);
+    }
+    if (data == NULL || read(fd, data, st.st_size) != st.st_size){
+        free(data);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    SnapshotHeader *header = (SnapshotHeader *) data;
+    char *pos = data + sizeof(SnapshotHeader);
+    char *end = data + st.st_size;
+    if (header->magic != key->magic || header->version != key->version ||
+        header->init_size != key->init_size ||
+        header->mtime_sec != key->mtime_sec ||
+        header->mtime_nsec != key->mtime_nsec ||
+        header->content_hash != key->content_hash ||
+        header->total_len != (uint64_t) st.st_size ||
+        header->path_len != key->path_len ||
+        (size_t)(end - pos) <= header->path_len ||
+        memcmp(pos, init_path, header->path_len + 1) != 0){
+        free(data);
+        return -1;
+    }
+    pos += header->path_len + 1;
+
+    // every name and value must end inside the file
+    char *check = pos;
+    for (uint32_t i = 0; i < 2 * header->num_vars; i++){
+        char *nul = memchr(check, '\0', end - check);
+        if (nul == NULL){
+            free(data);
+            return -1;
+        }
+        check = nul + 1;
+    }
+
+    for (uint32_t i = 0; i < header->num_vars; i++){
+        char *name = pos;
+        char *value = name + strlen(name) + 1;
+        pos = value + strlen(value) + 1;
+        if (vars_set(root, name, value) < 0){
+            free(data);
+            return -1;
+        }
+    }
+    free(data);
+    return 0;
+}
+
+static void write_snapshot(const char *file, const char *init_path,
+                           const SnapshotHeader *key, VarTable *root){
+    size_t len = sizeof(SnapshotHeader) + key->path_len + 1;
+    uint32_t num_vars = 0;
+    for (Variable *var = root->head; var != NULL; var = var->next){
+        len += strlen(var->name) + strlen(var->value) + 2;
+        num_vars++;
+    }
+    char *data = malloc(len);
+    if (data == NULL){
+        return;
+    }
+
+    SnapshotHeader *header = (SnapshotHeader *) data;
+    *header = *key;
+    header->num_vars = num_vars;
+    header->total_len = len;
+    char *pos = data + sizeof(SnapshotHeader);
+    memcpy(pos, init_path, key->path_len + 1);
+    pos += key->path_len + 1;
+    for (Variable *var = root->head; var != NULL; var = var->next){
+        size_t name_len = strlen(var->name) + 1;
+        size_t value_len = strlen(var->value) + 1;
+        memcpy(pos, var->name, name_len);
+        memcpy(pos + name_len, var->value, value_len);
+        pos += name_len + value_len;
+    }
+
+    // a snapshot that cannot be written just means running the file again
+    write_file_atomic(file, data, len);
+    free(data);
+}
+
+static int substitutes(const Word *word){
+    for (size_t i = 0; i < word->num_parts; i++){
+        if (word->parts[i].kind == PART_COMMAND){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+** Compiles every line of the init file, and if they are all
+** assignments, runs them. Returns 1 if it did, 0 if the file has some
+** other line (nothing has run), or -1 on error.
+*/
+static int run_assignments(ScriptReader *reader, VarTable *root){
+    Arena tmpl_arena = {0};
+    Arena arena = {0};
+    LineTemplate **lines = NULL;
+    size_t num_lines = 0;
+    size_t cap = 0;
+    int ret = 1;
+
+    char *line;
+    while ((line = reader_next(reader)) != NULL){
+        LineTemplate *tmpl = line == (char *) -1 ? (LineTemplate *) -1 :
+            compile_line(line, &tmpl_arena);
+        // run_script reports whatever went wrong
+        if (tmpl == (LineTemplate *) -1 || tmpl->num_stages > 0 ||
+            tmpl->background || tmpl->timed){
+            ret = 0;
+            break;
+        }
+        if (tmpl->assign_name == NULL){
+            continue;
+        }
+        // the output of a command can be different every time
+        if (substitutes(&tmpl->assign_value)){
+            ret = 0;
+            break;
+        }
+        if (num_lines == cap){
+            cap = cap ? cap * 2 : 16;
+            LineTemplate **grown = realloc(lines, cap * sizeof(LineTemplate *));
+            if (grown == NULL){
+                perror("run_init_file");
+                ret = -1;
+                break;
+            }
+            lines = grown;
+        }
+        lines[num_lines++] = tmpl;
+    }
+
+    for (size_t i = 0; ret > 0 && i < num_lines; i++){
+        if (instantiate_line(lines[i], root, &arena) == (Command *) -1){
+            ret = -1;
+        }
+        arena_reset(&arena);
+    }
+
+    free(lines);
+    arena_free(&arena);
+    arena_free(&tmpl_arena);
+    return ret;
+}
+
+
+int init_snapshot_open(const char *dir){
+    free(snapshot_dir);
+    snapshot_dir = strdup(dir);
+    if (snapshot_dir == NULL){
+        perror("init_snapshot_open");
+        return -1;
+    }
+    return 0;
+}
+
+void init_snapshot_close(){
+    free(snapshot_dir);
+    snapshot_dir = NULL;
+}
+
+
+int run_init_file(char *init_file, VarTable *root){
+    if (snapshot_dir == NULL){
+        return run_script(init_file, root);
+    }
+
+    // only a mapped file can be hashed up front
+    ScriptReader reader;
+    if (reader_open(&reader, init_file) < 0){
+        return -1;
+    }
+    char *init_path = reader.map ? realpath(init_file, NULL) : NULL;
+    char *file = init_path ? snapshot_file_for(init_path) : NULL;
+    if (file == NULL){
+        free(init_path);
+        reader_close(&reader);
+        return run_script(init_file, root);
+    }
+
+    SnapshotHeader key = {0};
+    key.magic = SNAPSHOT_MAGIC;
+    key.version = SNAPSHOT_VERSION;
+    key.path_len = strlen(init_path);
+    key.init_size = reader.st.st_size;
+    key.mtime_sec = reader.st.st_mtim.tv_sec;
+    key.mtime_nsec = reader.st.st_mtim.tv_nsec;
+    key.content_hash = hash_bytes(reader.map, reader.st.st_size);
+
+    int ret = 1;
+    trace_begin("init snapshot");
+    if (load_snapshot(file, init_path, &key, root) < 0){
+        ret = run_assignments(&reader, root);
+        if (ret > 0){
+            write_snapshot(file, init_path, &key, root);
+        }
+    }
+    trace_end("init snapshot");
+
+    reader_close(&reader);
+    free(file);
+    free(init_path);
+    // anything but assignments runs the usual way
+    return ret == 0 ? run_script(init_file, root) : ret;
+}
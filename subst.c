@@ -0,0 +1,238 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+#include <sys/mman.h>
+
+/*
+** Command substitution: $(...) in a word is replaced by what the command
+** wrote to its output. The line inside is compiled along with the word,
+** once, and each time the word is filled in it runs in one of three
+** ways:
+**
+**   only external commands   the last stage writes into a pipe that the
+**                            shell reads into a buffer, doubling it as
+**                            it fills, while the stages run
+**   builtins                 the last stage writes into a memfd; the
+**                            builtins run in the shell like anywhere
+**                            else and nothing has to read their output
+**                            while they write it, so nothing is forked
+**   cd, exit and the like    the whole line runs in a forked copy of the
+**                            shell writing into a pipe, so that like in
+**                            sh their effect ends with the substitution
+**
+** An assignment inside $(...) does nothing, for the same reason. A
+** background or timed line is run as a plain one.
+*/
+
+#define CAPTURE_INIT_SIZE 4096
+
+// reads fd to its end, growing *buf geometrically; returns the length
+static size_t read_all(int fd, char **buf, size_t *cap){
+    size_t len = 0;
+    for (;;){
+        if (len + 1 >= *cap){
+            size_t new_cap = *cap ? *cap * 2 : CAPTURE_INIT_SIZE;
+            char *grown = realloc(*buf, new_cap);
+            if (grown == NULL){
+                perror("capture_command");
+                exit(EXIT_FAILURE);
+            }
+            *buf = grown;
+            *cap = new_cap;
+        }
+        ssize_t n = read(fd, *buf + len, *cap - len - 1);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            return len;
+        }
+        len += n;
+    }
+}
+
+// waits for the children in pids; the status is the last stage's
+static int wait_stages(pid_t *pids, size_t num_stages, int status){
+    for (size_t j = 0; j < num_stages; j++){
+        if (pids[j] <= 0){
+            continue;
+        }
+        int wstatus = 0;
+        while (waitpid(pids[j], &wstatus, 0) == -1 && errno == EINTR){}
+        trace_child_exited(pids[j], wstatus);
+        if (j == num_stages - 1){
+            status = status_to_exit_code(wstatus);
+        }
+    }
+    return status;
+}
+
+// a line that failed to start may not have got to the last stage
+static void close_unused(Command *last){
+    if (last->stdout_fd != STDOUT_FILENO){
+        close(last->stdout_fd);
+        last->stdout_fd = STDOUT_FILENO;
+    }
+}
+
+// the last stage's output goes to a memfd, which is then read back
+static char *capture_builtins(Command *head, Command *last, size_t *len){
+    int fd = memfd_create("cscshell-capture", MFD_CLOEXEC);
+    if (fd == -1){
+        perror("memfd_create");
+        return NULL;
+    }
+    // start_line closes the stage's fd once it has run
+    last->stdout_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    int *result = execute_line(head);
+    close_unused(last);
+    if (result == (int *) -1){
+        close(fd);
+        return NULL;
+    }
+    free(result);
+
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) == 0){
+        buf = malloc(st.st_size + 1);
+    }
+    if (buf == NULL){
+        perror("capture_command");
+        close(fd);
+        return NULL;
+    }
+    *len = 0;
+    while (*len < (size_t) st.st_size){
+        ssize_t n = pread(fd, buf + *len, st.st_size - *len, *len);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            break;
+        }
+        *len += n;
+    }
+    close(fd);
+    return buf;
+}
+
+// the last stage's output goes to a pipe the shell reads as it runs
+static char *capture_external(Command *head, Command *last, size_t *len){
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1){
+        perror("pipe");
+        return NULL;
+    }
+    last->stdout_fd = pipe_fds[1];
+
+    size_t num_stages;
+    int status;
+    pid_t *pids = start_line(head, &num_stages, &status);
+    close_unused(last);
+    if (pids == NULL){
+        close(pipe_fds[0]);
+        return NULL;
+    }
+
+    char *buf = NULL;
+    size_t cap = 0;
+    *len = read_all(pipe_fds[0], &buf, &cap);
+    close(pipe_fds[0]);
+    set_status_variable("?", wait_stages(pids, num_stages, status < 0 ? 0 : status));
+    free(pids);
+    return buf;
+}
+
+// the whole line in a forked copy of the shell
+static char *capture_forked(Command *head, Command *last, size_t *len){
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1){
+        perror("pipe");
+        return NULL;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1){
+        perror("fork failed");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return NULL;
+    }
+    if (pid == 0){
+        trace_forked();
+        zygote_forked();
+        close(pipe_fds[0]);
+        last->stdout_fd = pipe_fds[1];
+        int *result = execute_line(head);
+        int status = result == (int *) -1 ? EXIT_FAILURE : result ? *result : 0;
+        exit_requested(&status);
+        fflush(stdout);
+        _exit(status);
+    }
+    trace_child_started(pid, "$(...)");
+    close(pipe_fds[1]);
+
+    char *buf = NULL;
+    size_t cap = 0;
+    *len = read_all(pipe_fds[0], &buf, &cap);
+    close(pipe_fds[0]);
+    set_status_variable("?", wait_stages(&pid, 1, 0));
+    return buf;
+}
+
+
+char *capture_command(LineTemplate *tmpl, VarTable *variables){
+    Arena arena = {0};
+    Command *head = NULL;
+    if (tmpl->assign_name == NULL){
+        head = instantiate_line(tmpl, variables, &arena);
+    }
+    if (head == (Command *) -1){
+        arena_free(&arena);
+        return NULL;
+    }
+    if (head == NULL){
+        arena_free(&arena);
+        return strdup("");
+    }
+    head->background = 0;
+    head->timed = 0;
+
+    Command *last = head;
+    int builtins = 0;
+    int changes_shell = 0;
+    for (Command *cmd = head; cmd != NULL; cmd = cmd->next){
+        builtins |= is_builtin(cmd->exec_path);
+        changes_shell |= builtin_changes_shell(cmd->exec_path);
+        last = cmd;
+    }
+
+    trace_begin("$(...)");
+    size_t len = 0;
+    char *output;
+    if (changes_shell){
+        output = capture_forked(head, last, &len);
+    }
+    else if (builtins){
+        output = capture_builtins(head, last, &len);
+    }
+    else {
+        output = capture_external(head, last, &len);
+    }
+    trace_end("$(...)");
+    arena_free(&arena);
+
+    if (output != NULL){
+        while (len > 0 && output[len - 1] == '\n'){
+            len--;
+        }
+        output[len] = '\0';
+    }
+    return output;
+}
@@ -0,0 +1,203 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+#include <stdarg.h>
+
+/*
+** Event tracing (--trace=FILE) in the Chrome trace JSON format, for
+** chrome://tracing or Perfetto. The shell's own work (reading,
+** compiling and instantiating lines, resolving commands, launching and
+** waiting for children) is recorded as begin/end pairs on the shell's
+** track. Each child's lifetime, from launch to reap, is one complete
+** event on a track of its own, keyed by its pid.
+**
+** Events are formatted into a buffer in memory that is written out
+** only when it fills up and at exit, so an event costs a clock read and
+** a snprintf, not a write.
+*/
+
+#define TRACE_BUF_SIZE (1 << 20)
+#define TRACE_EVENT_MAX 1024
+#define TRACE_NAME_MAX 256
+
+typedef struct TracedChild {
+    pid_t pid;
+    long start_us;
+    char name[TRACE_NAME_MAX];
+} TracedChild;
+
+static int trace_fd = -1;
+static pid_t shell_pid = 0;
+static char *buf = NULL;
+static size_t buf_len = 0;
+static int num_events = 0;
+
+// children launched and not reaped yet
+static TracedChild *children = NULL;
+static size_t num_children = 0;
+static size_t children_cap = 0;
+
+
+static long now_us(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+static void flush(){
+    for (size_t off = 0; off < buf_len;){
+        ssize_t n = write(trace_fd, buf + off, buf_len - off);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n < 0){
+            perror("trace");
+            break;
+        }
+        off += n;
+    }
+    buf_len = 0;
+}
+
+static void event(const char *fmt, ...){
+    if (TRACE_BUF_SIZE - buf_len < TRACE_EVENT_MAX){
+        flush();
+    }
+    if (num_events++ > 0){
+        buf[buf_len++] = ',';
+        buf[buf_len++] = '\n';
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + buf_len, TRACE_EVENT_MAX - 2, fmt, ap);
+    va_end(ap);
+    if (n > 0){
+        buf_len += (size_t) n < TRACE_EVENT_MAX - 2 ? (size_t) n : TRACE_EVENT_MAX - 3;
+    }
+}
+
+// name as the inside of a JSON string, cut short if it is too long
+static void json_name(char *out, const char *name){
+    size_t n = 0;
+    for (const unsigned char *p = (const unsigned char *) name;
+         *p && n + 7 < TRACE_NAME_MAX; p++){
+        if (*p == '"' || *p == '\\'){
+            out[n++] = '\\';
+            out[n++] = *p;
+        }
+        else if (*p < 0x20){
+            n += sprintf(out + n, "\\u%04x", *p);
+        }
+        else {
+            out[n++] = *p;
+        }
+    }
+    out[n] = '\0';
+}
+
+
+int trace_open(const char *file){
+    trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd == -1){
+        perror(file);
+        return -1;
+    }
+    buf = malloc(TRACE_BUF_SIZE);
+    if (buf == NULL){
+        perror("trace");
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    shell_pid = getpid();
+    memcpy(buf, "[\n", 2);
+    buf_len = 2;
+    event("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"cscshell\"}}", shell_pid);
+    return 0;
+}
+
+int trace_enabled(){
+    return trace_fd >= 0;
+}
+
+void trace_begin(const char *name){
+    if (trace_fd < 0){
+        return;
+    }
+    event("{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%ld,\"pid\":%d,\"tid\":%d}",
+          name, now_us(), shell_pid, shell_pid);
+}
+
+void trace_end(const char *name){
+    if (trace_fd < 0){
+        return;
+    }
+    event("{\"name\":\"%s\",\"ph\":\"E\",\"ts\":%ld,\"pid\":%d,\"tid\":%d}",
+          name, now_us(), shell_pid, shell_pid);
+}
+
+void trace_child_started(pid_t pid, const char *name){
+    if (trace_fd < 0 || pid <= 0){
+        return;
+    }
+    if (num_children == children_cap){
+        size_t new_cap = children_cap ? children_cap * 2 : 16;
+        TracedChild *grown = realloc(children, new_cap * sizeof(TracedChild));
+        if (grown == NULL){
+            return;
+        }
+        children = grown;
+        children_cap = new_cap;
+    }
+    TracedChild *child = &children[num_children++];
+    child->pid = pid;
+    child->start_us = now_us();
+    json_name(child->name, name);
+}
+
+void trace_child_exited(pid_t pid, int status){
+    if (trace_fd < 0){
+        return;
+    }
+    for (size_t i = 0; i < num_children; i++){
+        TracedChild *child = &children[i];
+        if (child->pid != pid){
+            continue;
+        }
+        long start = child->start_us;
+        event("{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%ld,"
+              "\"pid\":%d,\"tid\":%d,\"args\":{\"status\":%d}}",
+              child->name, start, now_us() - start, pid, pid,
+              status_to_exit_code(status));
+        children[i] = children[--num_children];
+        return;
+    }
+}
+
+void trace_forked(){
+    trace_fd = -1;
+}
+
+void trace_close(){
+    if (trace_fd < 0){
+        return;
+    }
+    if (TRACE_BUF_SIZE - buf_len < 4){
+        flush();
+    }
+    memcpy(buf + buf_len, "\n]\n", 3);
+    buf_len += 3;
+    flush();
+    close(trace_fd);
+    trace_fd = -1;
+    free(buf);
+    free(children);
+    buf = NULL;
+    children = NULL;
+    buf_len = num_children = children_cap = 0;
+}
@@ -0,0 +1,166 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+/*
+** The shell variable store. Variables are still Variable nodes chained
+** through next (in the order they were first assigned), but they are
+** found through an open-addressing index of pointers into that list:
+** linear probing, power of two capacity, load factor at most 1/2.
+** PATH is additionally kept in vars->path so the resolver never has to
+** look for it.
+*/
+
+static Variable **find_slot(VarTable *vars, const char *name, size_t len){
+    size_t mask = vars->cap - 1;
+    size_t i = hash_bytes(name, len) & mask;
+    while (vars->slots[i] != NULL){
+        Variable *var = vars->slots[i];
+        if (strncmp(var->name, name, len) == 0 && var->name[len] == '\0'){
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &vars->slots[i];
+}
+
+static int grow_slots(VarTable *vars){
+    size_t old_cap = vars->cap;
+    Variable **old = vars->slots;
+
+    vars->cap = old_cap ? old_cap * 2 : VARS_INIT_SLOTS;
+    vars->slots = calloc(vars->cap, sizeof(Variable *));
+    if (vars->slots == NULL){
+        perror("vars_set");
+        vars->slots = old;
+        vars->cap = old_cap;
+        return -1;
+    }
+
+    for (size_t i = 0; i < old_cap; i++){
+        if (old[i] != NULL){
+            *find_slot(vars, old[i]->name, strlen(old[i]->name)) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+
+Variable *vars_getn(VarTable *vars, const char *name, size_t len){
+    if (vars == NULL || vars->count == 0){
+        return NULL;
+    }
+    return *find_slot(vars, name, len);
+}
+
+
+Variable *vars_get(VarTable *vars, const char *name){
+    return vars_getn(vars, name, strlen(name));
+}
+
+
+int vars_set(VarTable *vars, const char *name, const char *value){
+    Variable *var = vars_get(vars, name);
+    char *new_value = strdup(value);
+    if (new_value == NULL){
+        perror("vars_set");
+        return -1;
+    }
+
+    if (var != NULL){
+        free(var->value);
+        var->value = new_value;
+        return 0;
+    }
+
+    if ((vars->count + 1) * 2 > vars->cap && grow_slots(vars) < 0){
+        free(new_value);
+        return -1;
+    }
+
+    var = malloc(sizeof(Variable));
+    if (var == NULL || (var->name = strdup(name)) == NULL){
+        perror("vars_set");
+        free(var);
+        free(new_value);
+        return -1;
+    }
+    var->value = new_value;
+    var->next = NULL;
+
+    if (vars->tail == NULL){
+        vars->head = var;
+    }
+    else {
+        vars->tail->next = var;
+    }
+    vars->tail = var;
+
+    *find_slot(vars, name, strlen(name)) = var;
+    vars->count++;
+
+    if (strcmp(name, PATH_VAR_NAME) == 0){
+        vars->path = var;
+    }
+    return 0;
+}
+
+
+int vars_unset(VarTable *vars, const char *name){
+    Variable *var = vars_get(vars, name);
+    if (var == NULL){
+        return 0;
+    }
+
+    // backward shift deletion: pull later entries of the probe run into
+    // the hole so that lookups never stop early at an empty slot
+    size_t mask = vars->cap - 1;
+    size_t hole = find_slot(vars, name, strlen(name)) - vars->slots;
+    size_t i = hole;
+    vars->slots[hole] = NULL;
+    for (;;){
+        i = (i + 1) & mask;
+        Variable *moved = vars->slots[i];
+        if (moved == NULL){
+            break;
+        }
+        size_t home = hash_bytes(moved->name, strlen(moved->name)) & mask;
+        // moved may fill the hole unless its home lies in (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask)){
+            vars->slots[hole] = moved;
+            vars->slots[i] = NULL;
+            hole = i;
+        }
+    }
+    vars->count--;
+
+    Variable *prev = NULL;
+    for (Variable *curr = vars->head; curr != var; curr = curr->next){
+        prev = curr;
+    }
+    if (prev == NULL){
+        vars->head = var->next;
+    }
+    else {
+        prev->next = var->next;
+    }
+    if (vars->tail == var){
+        vars->tail = prev;
+    }
+    if (vars->path == var){
+        vars->path = NULL;
+    }
+    free_variable(var, 0);
+    return 1;
+}
+
+
+void vars_free(VarTable *vars){
+    free_variable(vars->head, NON_ZERO_BYTE);
+    free(vars->slots);
+    memset(vars, 0, sizeof(VarTable));
+}
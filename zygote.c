@@ -0,0 +1,380 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+#include <signal.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/*
+** The zygote launch mode (--launch=zygote). A small helper is forked at
+** startup, before the shell has built up caches, history or variables,
+** and from then on starts every command on the shell's behalf, so the
+** cost of a launch stays that of forking the small helper however big
+** the shell grows.
+**
+** Each request goes over a socketpair: a ZygoteRequest, then argv, envp
+** and the redirection paths as NUL terminated strings, with the stage's
+** stdin/stdout pipe ends (and the shell's working directory, after a
+** cd) passed along as SCM_RIGHTS. The zygote clones the child with
+** CLONE_PARENT, which makes it a child of the shell rather than of the
+** zygote, and replies with its pid. Statuses then come back the usual
+** way: the shell gets SIGCHLD and waits for its children exactly as it
+** does for forked or spawned ones.
+**
+** The zygote exits when the shell closes its end of the socket. If it
+** goes away early, run_command falls back to posix_spawn.
+*/
+
+#define ZYGOTE_STDIN   0x1
+#define ZYGOTE_STDOUT  0x2
+#define ZYGOTE_REDIR_IN 0x4
+#define ZYGOTE_REDIR_OUT 0x8
+#define ZYGOTE_APPEND  0x10
+#define ZYGOTE_CHDIR   0x20
+#define ZYGOTE_MAX_FDS 3
+
+typedef struct ZygoteRequest {
+    uint32_t flags;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t len;
+} ZygoteRequest;
+
+static int zygote_fd = -1;
+static pid_t zygote_pid = 0;
+static int cwd_stale = 0;
+
+// the request payload, reused from one launch to the next
+static char *payload = NULL;
+static size_t payload_cap = 0;
+
+
+static int read_full(int fd, void *buf, size_t len){
+    for (size_t off = 0; off < len;){
+        ssize_t n = read(fd, (char *) buf + off, len - off);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+static int send_full(int fd, const void *buf, size_t len){
+    for (size_t off = 0; off < len;){
+        ssize_t n = send(fd, (const char *) buf + off, len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n < 0){
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+/*
+** In the child the zygote cloned: the same fd setup as the fork path of
+** run_command, then exec. Only async-signal-safe calls from here on.
+*/
+static void exec_child(const ZygoteRequest *req, int *fds, char *exec_path,
+                       char **argv, char **envp, char *redir_in, char *redir_out){
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+
+    size_t f = 0;
+    if ((req->flags & ZYGOTE_STDIN) && dup2(fds[f++], STDIN_FILENO) == -1){
+        perror("dup2");
+        _exit(EXIT_FAILURE);
+    }
+    if ((req->flags & ZYGOTE_STDOUT) && dup2(fds[f++], STDOUT_FILENO) == -1){
+        perror("dup2");
+        _exit(EXIT_FAILURE);
+    }
+    if (redir_in != NULL){
+        int in_fd = open(redir_in, O_RDONLY);
+        if (in_fd == -1){
+            perror("open");
+            _exit(EXIT_FAILURE);
+        }
+        dup2(in_fd, STDIN_FILENO);
+        close(in_fd);
+    }
+    if (redir_out != NULL){
+        int flags = O_WRONLY | O_CREAT |
+            ((req->flags & ZYGOTE_APPEND) ? O_APPEND : O_TRUNC);
+        int out_fd = open(redir_out, flags, 0644);
+        if (out_fd == -1){
+            perror("open");
+            _exit(EXIT_FAILURE);
+        }
+        dup2(out_fd, STDOUT_FILENO);
+        close(out_fd);
+    }
+
+    execve(exec_path, argv, envp);
+    perror("execve ");
+    _exit(EXIT_FAILURE);
+}
+
+// fills argv, envp and the paths in from the payload; 0 on success
+static int unpack(const ZygoteRequest *req, char *data, char **exec_path,
+                  char **argv, char **envp, char **redir_in, char **redir_out){
+    char *end = data + req->len;
+    char *p = data;
+
+    #define NEXT_STRING(dst) do { \
+        char *nul = memchr(p, '\0', end - p); \
+        if (nul == NULL) return -1; \
+        (dst) = p; \
+        p = nul + 1; \
+    } while (0)
+
+    NEXT_STRING(*exec_path);
+    for (uint32_t i = 0; i < req->argc; i++){
+        NEXT_STRING(argv[i]);
+    }
+    argv[req->argc] = NULL;
+    for (uint32_t i = 0; i < req->envc; i++){
+        NEXT_STRING(envp[i]);
+    }
+    envp[req->envc] = NULL;
+    *redir_in = *redir_out = NULL;
+    if (req->flags & ZYGOTE_REDIR_IN){
+        NEXT_STRING(*redir_in);
+    }
+    if (req->flags & ZYGOTE_REDIR_OUT){
+        NEXT_STRING(*redir_out);
+    }
+
+    #undef NEXT_STRING
+    return 0;
+}
+
+// the zygote itself: serves requests until the shell hangs up
+static void zygote_main(int sock){
+    // ^C is for the commands and the shell, the zygote outlives neither
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+
+    for (;;){
+        ZygoteRequest req;
+        int fds[ZYGOTE_MAX_FDS];
+        size_t num_fds = 0;
+        char control[CMSG_SPACE(sizeof(fds))];
+        struct iovec iov = {&req, sizeof(req)};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t n;
+        while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL)) == -1 &&
+               errno == EINTR){}
+        if (n != sizeof(req)){
+            _exit(0);
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)){
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+                num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+            }
+        }
+
+        char *data = malloc(req.len);
+        char **argv = malloc((req.argc + 1) * sizeof(char *));
+        char **envp = malloc((req.envc + 1) * sizeof(char *));
+        if (data == NULL || argv == NULL || envp == NULL ||
+            read_full(sock, data, req.len) < 0){
+            _exit(EXIT_FAILURE);
+        }
+
+        int32_t reply;
+        char *exec_path, *redir_in, *redir_out;
+        if (unpack(&req, data, &exec_path, argv, envp, &redir_in, &redir_out) < 0){
+            reply = -EINVAL;
+        }
+        else {
+            if ((req.flags & ZYGOTE_CHDIR) && num_fds > 0){
+                fchdir(fds[num_fds - 1]);
+            }
+            pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+            if (pid == 0){
+                exec_child(&req, fds, exec_path, argv, envp, redir_in, redir_out);
+            }
+            reply = pid == -1 ? -errno : pid;
+        }
+
+        for (size_t f = 0; f < num_fds; f++){
+            close(fds[f]);
+        }
+        free(data);
+        free(argv);
+        free(envp);
+        if (send_full(sock, &reply, sizeof(reply)) < 0){
+            _exit(0);
+        }
+    }
+}
+
+
+int zygote_start(){
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socks) == -1){
+        perror("socketpair");
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1){
+        perror("fork failed");
+        close(socks[0]);
+        close(socks[1]);
+        return -1;
+    }
+    if (pid == 0){
+        close(socks[0]);
+        zygote_main(socks[1]);
+    }
+    close(socks[1]);
+    zygote_fd = socks[0];
+    zygote_pid = pid;
+    return 0;
+}
+
+void zygote_cwd_changed(){
+    cwd_stale = 1;
+}
+
+static size_t put_string(size_t len, const char *str){
+    size_t str_len = strlen(str) + 1;
+    if (len + str_len > payload_cap){
+        size_t new_cap = payload_cap ? payload_cap : 4096;
+        while (new_cap < len + str_len){
+            new_cap *= 2;
+        }
+        char *grown = realloc(payload, new_cap);
+        if (grown == NULL){
+            perror("zygote");
+            exit(EXIT_FAILURE);
+        }
+        payload = grown;
+        payload_cap = new_cap;
+    }
+    memcpy(payload + len, str, str_len);
+    return len + str_len;
+}
+
+pid_t zygote_launch(Command *command){
+    if (zygote_fd < 0){
+        return -2;
+    }
+
+    ZygoteRequest req;
+    memset(&req, 0, sizeof(req));
+    size_t len = put_string(0, command->exec_path);
+    for (; command->args[req.argc] != NULL; req.argc++){
+        len = put_string(len, command->args[req.argc]);
+    }
+    for (; environ[req.envc] != NULL; req.envc++){
+        len = put_string(len, environ[req.envc]);
+    }
+    if (command->redir_in_path != NULL){
+        req.flags |= ZYGOTE_REDIR_IN;
+        len = put_string(len, command->redir_in_path);
+    }
+    if (command->redir_out_path != NULL){
+        req.flags |= ZYGOTE_REDIR_OUT;
+        len = put_string(len, command->redir_out_path);
+    }
+    if (command->redir_append){
+        req.flags |= ZYGOTE_APPEND;
+    }
+    req.len = len;
+
+    int fds[ZYGOTE_MAX_FDS];
+    size_t num_fds = 0;
+    if (command->stdin_fd != STDIN_FILENO){
+        req.flags |= ZYGOTE_STDIN;
+        fds[num_fds++] = command->stdin_fd;
+    }
+    if (command->stdout_fd != STDOUT_FILENO){
+        req.flags |= ZYGOTE_STDOUT;
+        fds[num_fds++] = command->stdout_fd;
+    }
+    int cwd_fd = -1;
+    if (cwd_stale && (cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) != -1){
+        req.flags |= ZYGOTE_CHDIR;
+        fds[num_fds++] = cwd_fd;
+    }
+
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (num_fds > 0){
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+    }
+
+    ssize_t sent;
+    while ((sent = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR){}
+    if (cwd_fd != -1){
+        close(cwd_fd);
+    }
+    int32_t reply;
+    if (sent != sizeof(req) || send_full(zygote_fd, payload, len) < 0 ||
+        read_full(zygote_fd, &reply, sizeof(reply)) < 0){
+        fprintf(stderr, "zygote: lost the launch helper, using posix_spawn\n");
+        zygote_stop();
+        return -2;
+    }
+    if (cwd_fd != -1){
+        cwd_stale = 0;
+    }
+    if (reply < 0){
+        errno = -reply;
+        perror("zygote: fork");
+        return -1;
+    }
+    return reply;
+}
+
+void zygote_forked(){
+    if (zygote_fd >= 0){
+        close(zygote_fd);
+        zygote_fd = -1;
+    }
+}
+
+void zygote_stop(){
+    if (zygote_fd < 0){
+        return;
+    }
+    close(zygote_fd);
+    zygote_fd = -1;
+    while (waitpid(zygote_pid, NULL, 0) == -1 && errno == EINTR){}
+    free(payload);
+    payload = NULL;
+    payload_cap = 0;
+}